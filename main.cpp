@@ -3,415 +3,7537 @@
 #include <sstream>
 #include <vector>
 #include <map>
+#include <set>
+#include <memory>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <iterator>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <future>
+#include <cerrno>
+#include <cstdint>
+#include <cmath>
+#include <cstdlib>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "fmt/core.h"
 
-struct Column {
-    std::string name;
-    std::string type;
-};
+thread_local bool quietOutput = false;
+thread_local std::string* capturedOutput = nullptr;
+
+struct FrameWriter;
+thread_local FrameWriter* frameOutput = nullptr;
+void writeMessageFrame(FrameWriter& frames, const std::string& text);
+
+void writeOutput(const std::string& text) {
+    if (quietOutput) {
+        return;
+    }
+    if (frameOutput != nullptr) {
+        writeMessageFrame(*frameOutput, text);
+    } else if (capturedOutput != nullptr) {
+        capturedOutput->append(text);
+    } else {
+        std::fwrite(text.data(), 1, text.size(), stdout);
+    }
+}
+
+template <typename... Args>
+void report(fmt::format_string<Args...> format, Args&&... args) {
+    if (!quietOutput) {
+        writeOutput(fmt::format(format, std::forward<Args>(args)...));
+    }
+}
+
+enum class ColumnType {
+    Int,
+    Double,
+    String
+};
+
+bool parseColumnType(const std::string& text, ColumnType& type) {
+    if (text == "int") {
+        type = ColumnType::Int;
+    } else if (text == "double") {
+        type = ColumnType::Double;
+    } else if (text == "string") {
+        type = ColumnType::String;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char* columnTypeName(ColumnType type) {
+    switch (type) {
+        case ColumnType::Int:
+            return "int";
+        case ColumnType::Double:
+            return "double";
+        default:
+            return "string";
+    }
+}
+
+struct Value {
+    bool isNull = true;
+    int64_t intValue = 0;
+    double doubleValue = 0;
+    std::string stringValue;
+
+    bool operator==(const Value& other) const {
+        return isNull == other.isNull && intValue == other.intValue && doubleValue == other.doubleValue && stringValue == other.stringValue;
+    }
+};
+
+struct ValueHash {
+    size_t operator()(const Value& value) const {
+        if (value.isNull) {
+            return 0;
+        }
+        double doubleValue = value.doubleValue == 0 ? 0 : value.doubleValue;
+        return std::hash<int64_t>()(value.intValue) ^ (std::hash<double>()(doubleValue) * 31) ^ std::hash<std::string>()(value.stringValue);
+    }
+};
+
+// Finalizer that spreads every input bit over the whole hash; std::hash of an
+// integer is the integer itself.
+uint64_t mixHash(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+bool parseValue(ColumnType type, const std::string& text, Value& value) {
+    value = Value();
+    if (text.empty()) {
+        return true;
+    }
+
+    char* end = nullptr;
+    errno = 0;
+    switch (type) {
+        case ColumnType::Int:
+            value.intValue = std::strtoll(text.c_str(), &end, 10);
+            break;
+        case ColumnType::Double:
+            value.doubleValue = std::strtod(text.c_str(), &end);
+            break;
+        case ColumnType::String:
+            value.stringValue = text;
+            value.isNull = false;
+            return true;
+    }
+    if (errno != 0 || end != text.c_str() + text.size()) {
+        return false;
+    }
+    value.isNull = false;
+    return true;
+}
+
+enum class CompareOp {
+    Equal,
+    NotEqual,
+    Less,
+    LessEqual,
+    Greater,
+    GreaterEqual,
+    Prefix
+};
+
+constexpr size_t invalidColumn = static_cast<size_t>(-1);
+constexpr size_t noLimit = static_cast<size_t>(-1);
+// Build rows per join partition, sized so a partition's slots and chains fit
+// in a core's L2 cache.
+constexpr size_t joinPartitionRows = 16384;
+
+enum class ExprKind {
+    Compare,
+    Between,
+    In,
+    And,
+    Or,
+    Not
+};
+
+struct Expr {
+    ExprKind kind;
+    CompareOp op = CompareOp::Equal;
+    std::string columnName;
+    std::vector<std::string> literals;
+    size_t column = invalidColumn;
+    std::vector<Value> values;
+    std::vector<std::unique_ptr<Expr>> children;
+
+    explicit Expr(ExprKind exprKind) : kind(exprKind) {}
+};
+
+class WhereParser {
+private:
+    enum class TokenKind {
+        Word,
+        Operator,
+        Literal,
+        Open,
+        Close,
+        Comma,
+        End
+    };
+
+    struct Token {
+        TokenKind kind;
+        std::string text;
+    };
+
+    std::vector<Token> tokens;
+    size_t pos = 0;
+    std::string error;
+
+    static bool isOperatorChar(char c) {
+        return c == ':' || c == '<' || c == '>' || c == '=' || c == '!' || c == '^';
+    }
+
+    static bool isDelimiter(char c) {
+        return std::isspace(static_cast<unsigned char>(c)) || c == '(' || c == ')' || c == ',';
+    }
+
+    static std::string lower(const std::string& text) {
+        std::string result(text);
+        for (auto& c : result) {
+            c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        }
+        return result;
+    }
+
+    // Where the literal after an operator at i starts. An operator followed by
+    // spaces, as in S > 5, takes the next word, unless that word starts the
+    // next condition or is a keyword: then the literal is empty, as in
+    // Dept: Name:Ann, which matches a null Dept.
+    static size_t spacedLiteral(const std::string& text, size_t i) {
+        size_t start = i;
+        while (start < text.size() && std::isspace(static_cast<unsigned char>(text[start]))) {
+            ++start;
+        }
+        if (start == i || start == text.size() || isDelimiter(text[start]) || isOperatorChar(text[start])) {
+            return i;
+        }
+        size_t end = start;
+        while (end < text.size() && !isDelimiter(text[end]) && !isOperatorChar(text[end])) {
+            ++end;
+        }
+        std::string word = lower(text.substr(start, end - start));
+        if (word == "and" || word == "or" || word == "not") {
+            return i;
+        }
+        size_t next = end;
+        while (next < text.size() && std::isspace(static_cast<unsigned char>(text[next]))) {
+            ++next;
+        }
+        if (next < text.size() && isOperatorChar(text[next])) {
+            return i;
+        }
+        size_t after = next;
+        while (after < text.size() && !isDelimiter(text[after]) && !isOperatorChar(text[after])) {
+            ++after;
+        }
+        std::string following = lower(text.substr(next, after - next));
+        return following == "between" || following == "in" ? i : start;
+    }
+
+    void tokenize(const std::string& text) {
+        size_t i = 0;
+        while (i < text.size()) {
+            char c = text[i];
+            if (std::isspace(static_cast<unsigned char>(c))) {
+                ++i;
+            } else if (c == '(' || c == ')' || c == ',') {
+                tokens.push_back({c == '(' ? TokenKind::Open : (c == ')' ? TokenKind::Close : TokenKind::Comma), std::string(1, c)});
+                ++i;
+            } else {
+                size_t start = i;
+                while (i < text.size() && !isDelimiter(text[i]) && !isOperatorChar(text[i])) {
+                    ++i;
+                }
+                if (i > start) {
+                    tokens.push_back({TokenKind::Word, text.substr(start, i - start)});
+                }
+                if (i < text.size() && isOperatorChar(text[i])) {
+                    start = i;
+                    while (i < text.size() && isOperatorChar(text[i]) && i - start < 2) {
+                        ++i;
+                    }
+                    tokens.push_back({TokenKind::Operator, text.substr(start, i - start)});
+                    i = spacedLiteral(text, i);
+                    start = i;
+                    while (i < text.size() && !isDelimiter(text[i])) {
+                        ++i;
+                    }
+                    tokens.push_back({TokenKind::Literal, text.substr(start, i - start)});
+                }
+            }
+        }
+        tokens.push_back({TokenKind::End, ""});
+    }
+
+    const Token& peek() const {
+        return tokens[pos];
+    }
+
+    bool peekKeyword(const char* keyword) const {
+        return peek().kind == TokenKind::Word && lower(peek().text) == keyword;
+    }
+
+    bool fail(const std::string& message) {
+        if (error.empty()) {
+            error = message;
+        }
+        return false;
+    }
+
+    bool parseOperator(const std::string& text, CompareOp& op) {
+        static const std::pair<const char*, CompareOp> operators[] = {
+            {":", CompareOp::Equal},
+            {"=", CompareOp::Equal},
+            {"!=", CompareOp::NotEqual},
+            {"<", CompareOp::Less},
+            {"<=", CompareOp::LessEqual},
+            {">", CompareOp::Greater},
+            {">=", CompareOp::GreaterEqual},
+            {"^=", CompareOp::Prefix},
+        };
+        for (const auto& entry : operators) {
+            if (text == entry.first) {
+                op = entry.second;
+                return true;
+            }
+        }
+        return fail("Unknown operator " + text);
+    }
+
+    bool parseLiteral(std::string& literal) {
+        if (peek().kind != TokenKind::Word && peek().kind != TokenKind::Literal) {
+            return fail("Expected a value");
+        }
+        literal = tokens[pos++].text;
+        return true;
+    }
+
+    bool parsePredicate(std::unique_ptr<Expr>& expr) {
+        if (peek().kind != TokenKind::Word) {
+            return fail("Expected a column name");
+        }
+        std::string columnName = tokens[pos++].text;
+
+        if (peek().kind == TokenKind::Operator) {
+            expr.reset(new Expr(ExprKind::Compare));
+            expr->columnName = columnName;
+            if (!parseOperator(tokens[pos++].text, expr->op)) {
+                return false;
+            }
+            expr->literals.push_back(tokens[pos++].text);
+            return true;
+        }
+
+        if (peekKeyword("between")) {
+            ++pos;
+            expr.reset(new Expr(ExprKind::Between));
+            expr->columnName = columnName;
+            expr->literals.resize(2);
+            if (!parseLiteral(expr->literals[0])) {
+                return false;
+            }
+            if (!peekKeyword("and")) {
+                return fail("Expected and in between");
+            }
+            ++pos;
+            return parseLiteral(expr->literals[1]);
+        }
+
+        if (peekKeyword("in")) {
+            ++pos;
+            expr.reset(new Expr(ExprKind::In));
+            expr->columnName = columnName;
+            if (peek().kind != TokenKind::Open) {
+                return fail("Expected ( after in");
+            }
+            ++pos;
+            while (true) {
+                std::string literal;
+                if (!parseLiteral(literal)) {
+                    return false;
+                }
+                expr->literals.push_back(literal);
+                if (peek().kind == TokenKind::Comma) {
+                    ++pos;
+                } else if (peek().kind == TokenKind::Close) {
+                    ++pos;
+                    return true;
+                } else {
+                    return fail("Expected , or ) in value list");
+                }
+            }
+        }
+
+        return fail("Expected an operator after " + columnName);
+    }
+
+    bool parseUnary(std::unique_ptr<Expr>& expr) {
+        if (peekKeyword("not")) {
+            ++pos;
+            expr.reset(new Expr(ExprKind::Not));
+            expr->children.emplace_back();
+            return parseUnary(expr->children.back());
+        }
+        if (peek().kind == TokenKind::Open) {
+            ++pos;
+            if (!parseOr(expr)) {
+                return false;
+            }
+            if (peek().kind != TokenKind::Close) {
+                return fail("Expected )");
+            }
+            ++pos;
+            return true;
+        }
+        return parsePredicate(expr);
+    }
+
+    bool parseAnd(std::unique_ptr<Expr>& expr) {
+        if (!parseUnary(expr)) {
+            return false;
+        }
+        while (peek().kind != TokenKind::End && peek().kind != TokenKind::Close && !peekKeyword("or")) {
+            if (peekKeyword("and")) {
+                ++pos;
+            }
+            std::unique_ptr<Expr> right;
+            if (!parseUnary(right)) {
+                return false;
+            }
+            expr = combine(ExprKind::And, std::move(expr), std::move(right));
+        }
+        return true;
+    }
+
+    bool parseOr(std::unique_ptr<Expr>& expr) {
+        if (!parseAnd(expr)) {
+            return false;
+        }
+        while (peekKeyword("or")) {
+            ++pos;
+            std::unique_ptr<Expr> right;
+            if (!parseAnd(right)) {
+                return false;
+            }
+            expr = combine(ExprKind::Or, std::move(expr), std::move(right));
+        }
+        return true;
+    }
+
+    static std::unique_ptr<Expr> combine(ExprKind kind, std::unique_ptr<Expr> left, std::unique_ptr<Expr> right) {
+        if (left->kind != kind) {
+            std::unique_ptr<Expr> node(new Expr(kind));
+            node->children.push_back(std::move(left));
+            left = std::move(node);
+        }
+        left->children.push_back(std::move(right));
+        return left;
+    }
+
+public:
+    bool parse(const std::string& text, std::unique_ptr<Expr>& expr) {
+        tokens.clear();
+        pos = 0;
+        error.clear();
+        tokenize(text);
+
+        expr.reset();
+        if (peek().kind == TokenKind::End) {
+            return true;
+        }
+        if (!parseOr(expr)) {
+            report("Error: Invalid where clause: {}\n", error);
+            return false;
+        }
+        if (peek().kind != TokenKind::End) {
+            report("Error: Invalid where clause: unexpected {}\n", peek().text);
+            return false;
+        }
+        return true;
+    }
+};
+
+int compareValues(ColumnType type, const Value& left, const Value& right) {
+    switch (type) {
+        case ColumnType::Int:
+            return left.intValue < right.intValue ? -1 : (right.intValue < left.intValue ? 1 : 0);
+        case ColumnType::Double:
+            return left.doubleValue < right.doubleValue ? -1 : (right.doubleValue < left.doubleValue ? 1 : 0);
+        default:
+            return left.stringValue.compare(right.stringValue);
+    }
+}
+
+struct KeyRange {
+    bool hasLower = false;
+    bool lowerInclusive = true;
+    Value lower;
+    bool hasUpper = false;
+    bool upperInclusive = true;
+    Value upper;
+    bool hasPrefix = false;
+    std::string prefix;
+};
+
+template <typename Key>
+const Key& keyOf(const Value& value);
+
+template <>
+const int64_t& keyOf<int64_t>(const Value& value) {
+    return value.intValue;
+}
+
+template <>
+const double& keyOf<double>(const Value& value) {
+    return value.doubleValue;
+}
+
+template <>
+const std::string& keyOf<std::string>(const Value& value) {
+    return value.stringValue;
+}
+
+inline bool keyHasPrefix(int64_t, const std::string&) {
+    return true;
+}
+
+inline bool keyHasPrefix(double, const std::string&) {
+    return true;
+}
+
+inline bool keyHasPrefix(const std::string& key, const std::string& prefix) {
+    return key.compare(0, prefix.size(), prefix) == 0;
+}
+
+template <typename Key>
+class BPlusTree {
+public:
+    struct Entry {
+        Key key;
+        size_t row;
+
+        bool operator<(const Entry& other) const {
+            return key < other.key || (!(other.key < key) && row < other.row);
+        }
+    };
+
+private:
+    static constexpr size_t cacheLine = 64;
+    static constexpr size_t nodeLines = 4;
+    static constexpr int capacity = sizeof(Entry) * 8 <= cacheLine * nodeLines ? static_cast<int>(cacheLine * nodeLines / sizeof(Entry)) : 8;
+
+    struct Node {
+        bool leaf;
+        int count = 0;
+
+        explicit Node(bool isLeaf) : leaf(isLeaf) {}
+    };
+
+    struct Leaf : Node {
+        Entry entries[capacity];
+        Leaf* next = nullptr;
+
+        Leaf() : Node(true) {}
+    };
+
+    struct Inner : Node {
+        Entry separators[capacity];
+        Node* children[capacity + 1];
+
+        Inner() : Node(false) {}
+    };
+
+    struct Split {
+        Node* right = nullptr;
+        Entry separator;
+    };
+
+    Node* root = nullptr;
+    size_t entryCount = 0;
+
+    static void destroy(Node* node) {
+        if (node == nullptr) {
+            return;
+        }
+        if (node->leaf) {
+            delete static_cast<Leaf*>(node);
+        } else {
+            Inner* inner = static_cast<Inner*>(node);
+            for (int i = 0; i <= inner->count; ++i) {
+                destroy(inner->children[i]);
+            }
+            delete inner;
+        }
+    }
+
+    static int childFor(const Inner* inner, const Entry& entry) {
+        return static_cast<int>(std::upper_bound(inner->separators, inner->separators + inner->count, entry) - inner->separators);
+    }
+
+    Leaf* findLeaf(const Entry& entry) const {
+        Node* node = root;
+        while (node != nullptr && !node->leaf) {
+            Inner* inner = static_cast<Inner*>(node);
+            node = inner->children[childFor(inner, entry)];
+        }
+        return static_cast<Leaf*>(node);
+    }
+
+    Leaf* firstLeaf() const {
+        Node* node = root;
+        while (node != nullptr && !node->leaf) {
+            node = static_cast<Inner*>(node)->children[0];
+        }
+        return static_cast<Leaf*>(node);
+    }
+
+    Split insertInto(Node* node, const Entry& entry) {
+        Split split;
+        if (node->leaf) {
+            Leaf* leaf = static_cast<Leaf*>(node);
+            int pos = static_cast<int>(std::lower_bound(leaf->entries, leaf->entries + leaf->count, entry) - leaf->entries);
+            if (leaf->count < capacity) {
+                std::move_backward(leaf->entries + pos, leaf->entries + leaf->count, leaf->entries + leaf->count + 1);
+                leaf->entries[pos] = entry;
+                ++leaf->count;
+                return split;
+            }
+
+            std::vector<Entry> merged(leaf->entries, leaf->entries + capacity);
+            merged.insert(merged.begin() + pos, entry);
+            int half = (capacity + 1) / 2;
+            Leaf* right = new Leaf();
+            std::move(merged.begin(), merged.begin() + half, leaf->entries);
+            std::move(merged.begin() + half, merged.end(), right->entries);
+            leaf->count = half;
+            right->count = capacity + 1 - half;
+            right->next = leaf->next;
+            leaf->next = right;
+            split.right = right;
+            split.separator = right->entries[0];
+            return split;
+        }
+
+        Inner* inner = static_cast<Inner*>(node);
+        int pos = childFor(inner, entry);
+        Split childSplit = insertInto(inner->children[pos], entry);
+        if (childSplit.right == nullptr) {
+            return split;
+        }
+
+        if (inner->count < capacity) {
+            std::move_backward(inner->separators + pos, inner->separators + inner->count, inner->separators + inner->count + 1);
+            std::move_backward(inner->children + pos + 1, inner->children + inner->count + 1, inner->children + inner->count + 2);
+            inner->separators[pos] = childSplit.separator;
+            inner->children[pos + 1] = childSplit.right;
+            ++inner->count;
+            return split;
+        }
+
+        std::vector<Entry> separators(inner->separators, inner->separators + capacity);
+        std::vector<Node*> children(inner->children, inner->children + capacity + 1);
+        separators.insert(separators.begin() + pos, childSplit.separator);
+        children.insert(children.begin() + pos + 1, childSplit.right);
+
+        int mid = (capacity + 1) / 2;
+        Inner* right = new Inner();
+        std::move(separators.begin(), separators.begin() + mid, inner->separators);
+        std::copy(children.begin(), children.begin() + mid + 1, inner->children);
+        inner->count = mid;
+        std::move(separators.begin() + mid + 1, separators.end(), right->separators);
+        std::copy(children.begin() + mid + 1, children.end(), right->children);
+        right->count = capacity - mid;
+        split.right = right;
+        split.separator = separators[mid];
+        return split;
+    }
+
+    // Nodes other than the root keep at least half their capacity, so range
+    // scans never walk runs of empty leaves after many erases.
+    static constexpr int minCount = capacity / 2;
+
+    bool eraseFrom(Node* node, const Entry& entry) {
+        if (node->leaf) {
+            Leaf* leaf = static_cast<Leaf*>(node);
+            Entry* pos = std::lower_bound(leaf->entries, leaf->entries + leaf->count, entry);
+            if (pos == leaf->entries + leaf->count || pos->row != entry.row || pos->key < entry.key || entry.key < pos->key) {
+                return false;
+            }
+            std::move(pos + 1, leaf->entries + leaf->count, pos);
+            --leaf->count;
+            return true;
+        }
+
+        Inner* inner = static_cast<Inner*>(node);
+        int pos = childFor(inner, entry);
+        if (!eraseFrom(inner->children[pos], entry)) {
+            return false;
+        }
+        if (inner->children[pos]->count < minCount) {
+            rebalance(inner, pos);
+        }
+        return true;
+    }
+
+    // Refills the underfull child at pos from a sibling, or merges the two
+    // when their entries fit in one node.
+    static void rebalance(Inner* parent, int pos) {
+        int separator = pos > 0 ? pos - 1 : pos;
+        Node* left = parent->children[separator];
+        Node* right = parent->children[separator + 1];
+
+        if (left->leaf) {
+            Leaf* leftLeaf = static_cast<Leaf*>(left);
+            Leaf* rightLeaf = static_cast<Leaf*>(right);
+            int total = leftLeaf->count + rightLeaf->count;
+            if (total <= capacity) {
+                std::move(rightLeaf->entries, rightLeaf->entries + rightLeaf->count, leftLeaf->entries + leftLeaf->count);
+                leftLeaf->count = total;
+                leftLeaf->next = rightLeaf->next;
+                delete rightLeaf;
+                removeChild(parent, separator);
+                return;
+            }
+            int half = total / 2;
+            if (leftLeaf->count < half) {
+                int moved = half - leftLeaf->count;
+                std::move(rightLeaf->entries, rightLeaf->entries + moved, leftLeaf->entries + leftLeaf->count);
+                std::move(rightLeaf->entries + moved, rightLeaf->entries + rightLeaf->count, rightLeaf->entries);
+                leftLeaf->count = half;
+                rightLeaf->count -= moved;
+            } else {
+                int moved = leftLeaf->count - half;
+                std::move_backward(rightLeaf->entries, rightLeaf->entries + rightLeaf->count, rightLeaf->entries + rightLeaf->count + moved);
+                std::move(leftLeaf->entries + half, leftLeaf->entries + leftLeaf->count, rightLeaf->entries);
+                leftLeaf->count = half;
+                rightLeaf->count += moved;
+            }
+            parent->separators[separator] = rightLeaf->entries[0];
+            return;
+        }
+
+        Inner* leftInner = static_cast<Inner*>(left);
+        Inner* rightInner = static_cast<Inner*>(right);
+        if (leftInner->count + rightInner->count + 1 <= capacity) {
+            leftInner->separators[leftInner->count] = parent->separators[separator];
+            std::move(rightInner->separators, rightInner->separators + rightInner->count, leftInner->separators + leftInner->count + 1);
+            std::copy(rightInner->children, rightInner->children + rightInner->count + 1, leftInner->children + leftInner->count + 1);
+            leftInner->count += rightInner->count + 1;
+            delete rightInner;
+            removeChild(parent, separator);
+        } else if (leftInner->count < rightInner->count) {
+            leftInner->separators[leftInner->count] = parent->separators[separator];
+            leftInner->children[leftInner->count + 1] = rightInner->children[0];
+            ++leftInner->count;
+            parent->separators[separator] = rightInner->separators[0];
+            std::move(rightInner->separators + 1, rightInner->separators + rightInner->count, rightInner->separators);
+            std::copy(rightInner->children + 1, rightInner->children + rightInner->count + 1, rightInner->children);
+            --rightInner->count;
+        } else {
+            std::move_backward(rightInner->separators, rightInner->separators + rightInner->count, rightInner->separators + rightInner->count + 1);
+            std::copy_backward(rightInner->children, rightInner->children + rightInner->count + 1, rightInner->children + rightInner->count + 2);
+            rightInner->separators[0] = parent->separators[separator];
+            rightInner->children[0] = leftInner->children[leftInner->count];
+            ++rightInner->count;
+            parent->separators[separator] = leftInner->separators[leftInner->count - 1];
+            --leftInner->count;
+        }
+    }
+
+    // Drops the separator at index and the child to its right.
+    static void removeChild(Inner* parent, int index) {
+        std::move(parent->separators + index + 1, parent->separators + parent->count, parent->separators + index);
+        std::copy(parent->children + index + 2, parent->children + parent->count + 1, parent->children + index + 1);
+        --parent->count;
+    }
+
+public:
+    BPlusTree() {}
+
+    BPlusTree(const BPlusTree&) = delete;
+    BPlusTree& operator=(const BPlusTree&) = delete;
+
+    ~BPlusTree() {
+        destroy(root);
+    }
+
+    size_t size() const {
+        return entryCount;
+    }
+
+    void clear() {
+        destroy(root);
+        root = nullptr;
+        entryCount = 0;
+    }
+
+    void insert(const Key& key, size_t row) {
+        Entry entry{key, row};
+        if (root == nullptr) {
+            root = new Leaf();
+        }
+        Split split = insertInto(root, entry);
+        if (split.right != nullptr) {
+            Inner* newRoot = new Inner();
+            newRoot->separators[0] = split.separator;
+            newRoot->children[0] = root;
+            newRoot->children[1] = split.right;
+            newRoot->count = 1;
+            root = newRoot;
+        }
+        ++entryCount;
+    }
+
+    void erase(const Key& key, size_t row) {
+        if (root == nullptr || !eraseFrom(root, Entry{key, row})) {
+            return;
+        }
+        --entryCount;
+        if (root->leaf && root->count == 0) {
+            delete static_cast<Leaf*>(root);
+            root = nullptr;
+        } else if (!root->leaf && root->count == 0) {
+            Inner* emptied = static_cast<Inner*>(root);
+            root = emptied->children[0];
+            delete emptied;
+        }
+    }
+
+    template <typename Visitor>
+    void scanFrom(const Key* lower, Visitor visit) const {
+        Leaf* leaf;
+        int pos = 0;
+        if (lower != nullptr) {
+            Entry start{*lower, 0};
+            leaf = findLeaf(start);
+            if (leaf != nullptr) {
+                pos = static_cast<int>(std::lower_bound(leaf->entries, leaf->entries + leaf->count, start) - leaf->entries);
+            }
+        } else {
+            leaf = firstLeaf();
+        }
+
+        for (; leaf != nullptr; leaf = leaf->next, pos = 0) {
+            for (; pos < leaf->count; ++pos) {
+                if (!visit(leaf->entries[pos])) {
+                    return;
+                }
+            }
+        }
+    }
+};
+
+struct OrderedIndex {
+    size_t column;
+
+    explicit OrderedIndex(size_t indexColumn) : column(indexColumn) {}
+    virtual ~OrderedIndex() {}
+
+    virtual void insert(const Value& key, size_t row) = 0;
+    virtual void erase(const Value& key, size_t row) = 0;
+    virtual void clear() = 0;
+    virtual void collect(const KeyRange& range, std::vector<size_t>& rows) const = 0;
+};
+
+template <typename Key>
+struct BTreeIndex : OrderedIndex {
+    BPlusTree<Key> tree;
+
+    explicit BTreeIndex(size_t indexColumn) : OrderedIndex(indexColumn) {}
+
+    void insert(const Value& key, size_t row) override {
+        if (!key.isNull) {
+            tree.insert(keyOf<Key>(key), row);
+        }
+    }
+
+    void erase(const Value& key, size_t row) override {
+        if (!key.isNull) {
+            tree.erase(keyOf<Key>(key), row);
+        }
+    }
+
+    void clear() override {
+        tree.clear();
+    }
+
+    void collect(const KeyRange& range, std::vector<size_t>& rows) const override {
+        const Key* lower = nullptr;
+        if (range.hasLower) {
+            lower = &keyOf<Key>(range.lower);
+        }
+        const Key* upper = range.hasUpper ? &keyOf<Key>(range.upper) : nullptr;
+
+        tree.scanFrom(lower, [&](const typename BPlusTree<Key>::Entry& entry) {
+            if (lower != nullptr && !range.lowerInclusive && !(*lower < entry.key)) {
+                return true;
+            }
+            if (upper != nullptr && (range.upperInclusive ? *upper < entry.key : !(entry.key < *upper))) {
+                return false;
+            }
+            if (range.hasPrefix && !keyHasPrefix(entry.key, range.prefix)) {
+                return false;
+            }
+            rows.push_back(entry.row);
+            return true;
+        });
+    }
+};
+
+template <typename T>
+void appendBinary(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+void appendBinary(std::string& out, const std::string& text) {
+    appendBinary<uint32_t>(out, static_cast<uint32_t>(text.size()));
+    out += text;
+}
+
+struct Checksum {
+    uint64_t hash = 14695981039346656037ULL;
+    uint64_t pending = 0;
+    size_t pendingBytes = 0;
+    uint64_t total = 0;
+
+    void mix(uint64_t word) {
+        hash = (hash ^ word) * 1099511628211ULL;
+        hash ^= hash >> 29;
+    }
+
+    void update(const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        total += size;
+        while (size > 0 && pendingBytes != 0) {
+            pending |= static_cast<uint64_t>(*bytes++) << (8 * pendingBytes);
+            --size;
+            if (++pendingBytes == 8) {
+                mix(pending);
+                pending = 0;
+                pendingBytes = 0;
+            }
+        }
+        for (; size >= 8; size -= 8, bytes += 8) {
+            uint64_t word;
+            std::memcpy(&word, bytes, 8);
+            mix(word);
+        }
+        while (size > 0) {
+            pending |= static_cast<uint64_t>(*bytes++) << (8 * pendingBytes++);
+            --size;
+        }
+    }
+
+    uint64_t finish() const {
+        Checksum result(*this);
+        if (result.pendingBytes != 0) {
+            result.mix(result.pending);
+        }
+        result.mix(total);
+        return result.hash;
+    }
+};
+
+// Work-stealing scheduler for the parallel parts of statements. Each worker
+// runs tasks from the back of its own deque and steals from the front of the
+// others' when it runs dry. Threads waiting in parallelFor run tasks too, so
+// nested parallel work cannot deadlock the workers.
+class Scheduler {
+public:
+    struct WorkerStats {
+        uint64_t executed;
+        uint64_t stolen;
+        uint64_t busyNanos;
+        size_t queued;
+    };
+
+    explicit Scheduler(size_t count) : started(std::chrono::steady_clock::now()) {
+        for (size_t i = 0; i < count; ++i) {
+            workers.emplace_back(new Worker());
+        }
+        for (auto& worker : workers) {
+            worker->thread = std::thread(&Scheduler::run, this, worker.get());
+        }
+    }
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    ~Scheduler() {
+        {
+            std::lock_guard<std::mutex> guard(sleepLock);
+            stopping = true;
+        }
+        wakeup.notify_all();
+        for (auto& worker : workers) {
+            worker->thread.join();
+        }
+    }
+
+    // Threads that can work on one parallelFor: the workers and the caller.
+    size_t size() const {
+        return workers.size() + 1;
+    }
+
+    template <typename Task>
+    void parallelFor(size_t count, Task task) {
+        if (count == 0) {
+            return;
+        }
+        std::atomic<size_t> remaining{count};
+        for (size_t i = 1; i < count; ++i) {
+            push([&task, &remaining, i] {
+                task(i);
+                --remaining;
+            });
+        }
+        task(0);
+        --remaining;
+
+        Worker* self = owner == this ? current : nullptr;
+        while (remaining.load() != 0) {
+            if (!runOne(self)) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    std::vector<WorkerStats> stats() {
+        std::vector<WorkerStats> result;
+        for (auto& worker : workers) {
+            std::lock_guard<std::mutex> guard(worker->lock);
+            result.push_back({worker->executed.load(), worker->stolen.load(), worker->busyNanos.load(), worker->tasks.size()});
+        }
+        return result;
+    }
+
+    uint64_t uptimeNanos() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count();
+    }
+
+private:
+    struct Worker {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+        std::atomic<uint64_t> executed{0};
+        std::atomic<uint64_t> stolen{0};
+        std::atomic<uint64_t> busyNanos{0};
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::chrono::steady_clock::time_point started;
+    std::mutex sleepLock;
+    std::condition_variable wakeup;
+    std::atomic<size_t> queued{0};
+    std::atomic<size_t> nextQueue{0};
+    bool stopping = false;
+
+    static thread_local Scheduler* owner;
+    static thread_local Worker* current;
+
+    void push(std::function<void()> task) {
+        Worker* target = owner == this ? current : nullptr;
+        if (target == nullptr && !workers.empty()) {
+            target = workers[nextQueue++ % workers.size()].get();
+        }
+        if (target == nullptr) {
+            task();
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> guard(target->lock);
+            target->tasks.push_back(std::move(task));
+        }
+        ++queued;
+        {
+            std::lock_guard<std::mutex> guard(sleepLock);
+        }
+        wakeup.notify_one();
+    }
+
+    bool take(Worker* self, std::function<void()>& task, bool& stolen) {
+        if (self != nullptr) {
+            std::lock_guard<std::mutex> guard(self->lock);
+            if (!self->tasks.empty()) {
+                task = std::move(self->tasks.back());
+                self->tasks.pop_back();
+                stolen = false;
+                return true;
+            }
+        }
+        size_t start = nextQueue.load();
+        for (size_t i = 0; i < workers.size(); ++i) {
+            Worker* victim = workers[(start + i) % workers.size()].get();
+            if (victim == self) {
+                continue;
+            }
+            std::lock_guard<std::mutex> guard(victim->lock);
+            if (!victim->tasks.empty()) {
+                task = std::move(victim->tasks.front());
+                victim->tasks.pop_front();
+                stolen = true;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool runOne(Worker* self) {
+        std::function<void()> task;
+        bool stolen = false;
+        if (queued.load() == 0 || !take(self, task, stolen)) {
+            return false;
+        }
+        --queued;
+        auto begin = std::chrono::steady_clock::now();
+        task();
+        if (self != nullptr) {
+            self->busyNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+            ++self->executed;
+            self->stolen += stolen;
+        }
+        return true;
+    }
+
+    void run(Worker* self) {
+        owner = this;
+        current = self;
+        quietOutput = true;
+        while (true) {
+            if (runOne(self)) {
+                continue;
+            }
+            std::unique_lock<std::mutex> guard(sleepLock);
+            wakeup.wait(guard, [this] {
+                return stopping || queued.load() != 0;
+            });
+            if (stopping && queued.load() == 0) {
+                return;
+            }
+        }
+    }
+};
+
+thread_local Scheduler* Scheduler::owner = nullptr;
+thread_local Scheduler::Worker* Scheduler::current = nullptr;
+
+// The scheduler of the running database, for the column decoding that tables
+// do on their own.
+Scheduler* taskScheduler = nullptr;
+
+struct Mapping {
+    void* address = nullptr;
+    size_t length = 0;
+
+    Mapping(void* mappedAddress, size_t mappedLength) : address(mappedAddress), length(mappedLength) {}
+    Mapping(const Mapping&) = delete;
+    Mapping& operator=(const Mapping&) = delete;
+
+    ~Mapping() {
+        munmap(address, length);
+    }
+};
+
+struct MappedBlock {
+    std::shared_ptr<const Mapping> mapping;
+    const char* data;
+    uint64_t length;
+    uint64_t checksum;
+    size_t rows;
+};
+
+// Predicate kernels compare a batch of column values against a constant and set
+// one bit per row. The widest instruction set the CPU supports is picked once
+// at startup; without one, scans keep filtering selection vectors row by row.
+constexpr size_t kernelRows = 1024;
+
+using IntKernel = void (*)(const int64_t* data, size_t count, int64_t value, uint64_t* bits);
+using DoubleKernel = void (*)(const double* data, size_t count, double value, uint64_t* bits);
+using ValidKernel = void (*)(const uint8_t* nulls, size_t count, uint64_t* bits);
+
+template <CompareOp Op, typename T>
+inline bool compareValue(T left, T right) {
+    switch (Op) {
+        case CompareOp::Less:
+            return left < right;
+        case CompareOp::LessEqual:
+            return left <= right;
+        case CompareOp::Greater:
+            return left > right;
+        case CompareOp::GreaterEqual:
+            return left >= right;
+        default:
+            return left == right;
+    }
+}
+
+// Finishes the rows a kernel's vector loop left over.
+template <CompareOp Op, typename T>
+void compareTail(const T* data, size_t start, size_t count, T value, uint64_t* bits) {
+    for (size_t i = start; i < count; ++i) {
+        bits[i / 64] |= uint64_t(compareValue<Op>(data[i], value)) << (i % 64);
+    }
+}
+
+inline void validTail(const uint8_t* nulls, size_t start, size_t count, uint64_t* bits) {
+    for (size_t i = start; i < count; ++i) {
+        bits[i / 64] |= uint64_t(nulls[i] == 0) << (i % 64);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+template <CompareOp Op>
+__attribute__((target("sse4.2"))) void compareIntsSse(const int64_t* data, size_t count, int64_t value, uint64_t* bits) {
+    std::memset(bits, 0, (count + 63) / 64 * 8);
+    __m128i needle = _mm_set1_epi64x(value);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i mask;
+        switch (Op) {
+            case CompareOp::Less:
+                mask = _mm_cmpgt_epi64(needle, values);
+                break;
+            case CompareOp::LessEqual:
+                mask = _mm_xor_si128(_mm_cmpgt_epi64(values, needle), _mm_set1_epi64x(-1));
+                break;
+            case CompareOp::Greater:
+                mask = _mm_cmpgt_epi64(values, needle);
+                break;
+            case CompareOp::GreaterEqual:
+                mask = _mm_xor_si128(_mm_cmpgt_epi64(needle, values), _mm_set1_epi64x(-1));
+                break;
+            default:
+                mask = _mm_cmpeq_epi64(values, needle);
+                break;
+        }
+        bits[i / 64] |= uint64_t(_mm_movemask_pd(_mm_castsi128_pd(mask))) << (i % 64);
+    }
+    compareTail<Op>(data, i, count, value, bits);
+}
+
+template <CompareOp Op>
+__attribute__((target("sse4.2"))) void compareDoublesSse(const double* data, size_t count, double value, uint64_t* bits) {
+    std::memset(bits, 0, (count + 63) / 64 * 8);
+    __m128d needle = _mm_set1_pd(value);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128d values = _mm_loadu_pd(data + i);
+        __m128d mask;
+        switch (Op) {
+            case CompareOp::Less:
+                mask = _mm_cmplt_pd(values, needle);
+                break;
+            case CompareOp::LessEqual:
+                mask = _mm_cmple_pd(values, needle);
+                break;
+            case CompareOp::Greater:
+                mask = _mm_cmpgt_pd(values, needle);
+                break;
+            case CompareOp::GreaterEqual:
+                mask = _mm_cmpge_pd(values, needle);
+                break;
+            default:
+                mask = _mm_cmpeq_pd(values, needle);
+                break;
+        }
+        bits[i / 64] |= uint64_t(_mm_movemask_pd(mask)) << (i % 64);
+    }
+    compareTail<Op>(data, i, count, value, bits);
+}
+
+__attribute__((target("sse4.2"))) void validSse(const uint8_t* nulls, size_t count, uint64_t* bits) {
+    std::memset(bits, 0, (count + 63) / 64 * 8);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(nulls + i));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(values, _mm_setzero_si128()));
+        bits[i / 64] |= uint64_t(mask) << (i % 64);
+    }
+    validTail(nulls, i, count, bits);
+}
+
+template <CompareOp Op>
+__attribute__((target("avx2"))) void compareIntsAvx2(const int64_t* data, size_t count, int64_t value, uint64_t* bits) {
+    std::memset(bits, 0, (count + 63) / 64 * 8);
+    __m256i needle = _mm256_set1_epi64x(value);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i values = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i mask;
+        switch (Op) {
+            case CompareOp::Less:
+                mask = _mm256_cmpgt_epi64(needle, values);
+                break;
+            case CompareOp::LessEqual:
+                mask = _mm256_xor_si256(_mm256_cmpgt_epi64(values, needle), _mm256_set1_epi64x(-1));
+                break;
+            case CompareOp::Greater:
+                mask = _mm256_cmpgt_epi64(values, needle);
+                break;
+            case CompareOp::GreaterEqual:
+                mask = _mm256_xor_si256(_mm256_cmpgt_epi64(needle, values), _mm256_set1_epi64x(-1));
+                break;
+            default:
+                mask = _mm256_cmpeq_epi64(values, needle);
+                break;
+        }
+        bits[i / 64] |= uint64_t(_mm256_movemask_pd(_mm256_castsi256_pd(mask))) << (i % 64);
+    }
+    compareTail<Op>(data, i, count, value, bits);
+}
+
+template <CompareOp Op>
+__attribute__((target("avx2"))) void compareDoublesAvx2(const double* data, size_t count, double value, uint64_t* bits) {
+    std::memset(bits, 0, (count + 63) / 64 * 8);
+    __m256d needle = _mm256_set1_pd(value);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d values = _mm256_loadu_pd(data + i);
+        __m256d mask;
+        switch (Op) {
+            case CompareOp::Less:
+                mask = _mm256_cmp_pd(values, needle, _CMP_LT_OQ);
+                break;
+            case CompareOp::LessEqual:
+                mask = _mm256_cmp_pd(values, needle, _CMP_LE_OQ);
+                break;
+            case CompareOp::Greater:
+                mask = _mm256_cmp_pd(values, needle, _CMP_GT_OQ);
+                break;
+            case CompareOp::GreaterEqual:
+                mask = _mm256_cmp_pd(values, needle, _CMP_GE_OQ);
+                break;
+            default:
+                mask = _mm256_cmp_pd(values, needle, _CMP_EQ_OQ);
+                break;
+        }
+        bits[i / 64] |= uint64_t(_mm256_movemask_pd(mask)) << (i % 64);
+    }
+    compareTail<Op>(data, i, count, value, bits);
+}
+
+__attribute__((target("avx2"))) void validAvx2(const uint8_t* nulls, size_t count, uint64_t* bits) {
+    std::memset(bits, 0, (count + 63) / 64 * 8);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i values = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(nulls + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(values, _mm256_setzero_si256()));
+        bits[i / 64] |= uint64_t(mask) << (i % 64);
+    }
+    validTail(nulls, i, count, bits);
+}
+#endif
+
+// Indexed by CompareOp. NotEqual runs the Equal kernel; the caller inverts the
+// bits so that nulls count as not equal. All null when there is no SIMD.
+struct PredicateKernels {
+    IntKernel ints[6];
+    DoubleKernel doubles[6];
+    ValidKernel valid;
+};
+
+// The widest instruction set scans may use, set by --kernels before the first
+// scan: avx2, sse4.2 or scalar.
+std::string widestKernels = "avx2";
+
+PredicateKernels selectKernels() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (widestKernels == "avx2" && __builtin_cpu_supports("avx2")) {
+        return {{compareIntsAvx2<CompareOp::Equal>, compareIntsAvx2<CompareOp::Equal>, compareIntsAvx2<CompareOp::Less>,
+                 compareIntsAvx2<CompareOp::LessEqual>, compareIntsAvx2<CompareOp::Greater>, compareIntsAvx2<CompareOp::GreaterEqual>},
+                {compareDoublesAvx2<CompareOp::Equal>, compareDoublesAvx2<CompareOp::Equal>, compareDoublesAvx2<CompareOp::Less>,
+                 compareDoublesAvx2<CompareOp::LessEqual>, compareDoublesAvx2<CompareOp::Greater>, compareDoublesAvx2<CompareOp::GreaterEqual>},
+                validAvx2};
+    }
+    if (widestKernels != "scalar" && __builtin_cpu_supports("sse4.2")) {
+        return {{compareIntsSse<CompareOp::Equal>, compareIntsSse<CompareOp::Equal>, compareIntsSse<CompareOp::Less>,
+                 compareIntsSse<CompareOp::LessEqual>, compareIntsSse<CompareOp::Greater>, compareIntsSse<CompareOp::GreaterEqual>},
+                {compareDoublesSse<CompareOp::Equal>, compareDoublesSse<CompareOp::Equal>, compareDoublesSse<CompareOp::Less>,
+                 compareDoublesSse<CompareOp::LessEqual>, compareDoublesSse<CompareOp::Greater>, compareDoublesSse<CompareOp::GreaterEqual>},
+                validSse};
+    }
+#endif
+    return {};
+}
+
+const PredicateKernels& predicateKernels() {
+    static const PredicateKernels kernels = selectKernels();
+    return kernels;
+}
+
+struct Column {
+    std::string name;
+    ColumnType type;
+    std::vector<int64_t> ints;
+    std::vector<double> doubles;
+    std::vector<std::string> strings;
+    std::vector<uint8_t> nulls;
+    std::vector<MappedBlock> mapped;
+
+    Column() = default;
+    Column(const std::string& columnName, ColumnType columnType) : name(columnName), type(columnType) {}
+
+    bool isLoaded() const {
+        return mapped.empty();
+    }
+
+    bool decodeBlock(const MappedBlock& block, size_t start) {
+        Checksum checksum;
+        checksum.update(block.data, block.length);
+        if (checksum.finish() != block.checksum) {
+            return false;
+        }
+
+        size_t rows = block.rows;
+        size_t nullBytes = (rows + 7) / 8;
+        size_t valuesOffset = (nullBytes + 7) / 8 * 8;
+        size_t valueBytes = type == ColumnType::String ? (rows + 1) * 8 : rows * 8;
+        if (valuesOffset + valueBytes > block.length) {
+            return false;
+        }
+
+        for (size_t row = 0; row < rows; ++row) {
+            nulls[start + row] = block.data[row / 8] >> (row % 8) & 1;
+        }
+
+        const char* values = block.data + valuesOffset;
+        switch (type) {
+            case ColumnType::Int:
+                std::memcpy(ints.data() + start, values, rows * 8);
+                break;
+            case ColumnType::Double:
+                std::memcpy(doubles.data() + start, values, rows * 8);
+                break;
+            case ColumnType::String: {
+                const char* blob = values + valueBytes;
+                uint64_t blobLength = block.length - valuesOffset - valueBytes;
+                uint64_t begin;
+                std::memcpy(&begin, values, 8);
+                for (size_t row = 0; row < rows; ++row) {
+                    uint64_t end;
+                    std::memcpy(&end, values + (row + 1) * 8, 8);
+                    if (end < begin || end > blobLength) {
+                        return false;
+                    }
+                    strings[start + row].assign(blob + begin, end - begin);
+                    begin = end;
+                }
+                break;
+            }
+        }
+        return true;
+    }
+
+    // Decodes every mapped block of the column into its vectors. Mapped files
+    // are lazy per column only: the first statement that uses a column pays
+    // for all of its cells, and filters always run on the decoded vectors.
+    bool materialize() {
+        if (mapped.empty()) {
+            return true;
+        }
+
+        size_t rows = 0;
+        for (const auto& block : mapped) {
+            rows += block.rows;
+        }
+        resize(rows);
+
+        std::vector<size_t> starts(mapped.size());
+        for (size_t i = 1; i < mapped.size(); ++i) {
+            starts[i] = starts[i - 1] + mapped[i - 1].rows;
+        }
+        std::atomic<bool> valid{true};
+        auto decode = [this, &starts, &valid](size_t i) {
+            if (!decodeBlock(mapped[i], starts[i])) {
+                valid = false;
+            }
+        };
+        if (taskScheduler != nullptr && mapped.size() > 1) {
+            taskScheduler->parallelFor(mapped.size(), decode);
+        } else {
+            for (size_t i = 0; i < mapped.size() && valid; ++i) {
+                decode(i);
+            }
+        }
+        if (!valid) {
+            resize(0);
+            return false;
+        }
+        mapped.clear();
+        return true;
+    }
+
+    void resize(size_t rows) {
+        switch (type) {
+            case ColumnType::Int:
+                ints.resize(rows);
+                break;
+            case ColumnType::Double:
+                doubles.resize(rows);
+                break;
+            case ColumnType::String:
+                strings.resize(rows);
+                break;
+        }
+        nulls.resize(rows, 1);
+    }
+
+    void append(const Value& value) {
+        switch (type) {
+            case ColumnType::Int:
+                ints.push_back(value.intValue);
+                break;
+            case ColumnType::Double:
+                doubles.push_back(value.doubleValue);
+                break;
+            case ColumnType::String:
+                strings.push_back(value.stringValue);
+                break;
+        }
+        nulls.push_back(value.isNull);
+    }
+
+    bool appendText(const char* begin, const char* end) {
+        if (begin == end) {
+            resize(nulls.size() + 1);
+            return true;
+        }
+
+        char* parsedEnd = nullptr;
+        errno = 0;
+        switch (type) {
+            case ColumnType::Int:
+                ints.push_back(std::strtoll(begin, &parsedEnd, 10));
+                break;
+            case ColumnType::Double:
+                doubles.push_back(std::strtod(begin, &parsedEnd));
+                break;
+            case ColumnType::String:
+                strings.emplace_back(begin, end);
+                nulls.push_back(0);
+                return true;
+        }
+        nulls.push_back(0);
+        return errno == 0 && parsedEnd == end && !std::isspace(static_cast<unsigned char>(*begin));
+    }
+
+    void set(size_t row, const Value& value) {
+        switch (type) {
+            case ColumnType::Int:
+                ints[row] = value.intValue;
+                break;
+            case ColumnType::Double:
+                doubles[row] = value.doubleValue;
+                break;
+            case ColumnType::String:
+                strings[row] = value.stringValue;
+                break;
+        }
+        nulls[row] = value.isNull;
+    }
+
+    template <typename T, typename Compare>
+    void filterValues(const std::vector<T>& data, const T& value, Compare compare, std::vector<size_t>& selection) const {
+        size_t out = 0;
+        for (size_t row : selection) {
+            selection[out] = row;
+            out += !nulls[row] && compare(data[row], value);
+        }
+        selection.resize(out);
+    }
+
+    template <typename T>
+    void filterTyped(const std::vector<T>& data, CompareOp op, const T& value, std::vector<size_t>& selection) const {
+        switch (op) {
+            case CompareOp::Equal:
+                filterValues(data, value, std::equal_to<T>(), selection);
+                break;
+            case CompareOp::NotEqual:
+                filterValues(data, value, std::not_equal_to<T>(), selection);
+                break;
+            case CompareOp::Less:
+                filterValues(data, value, std::less<T>(), selection);
+                break;
+            case CompareOp::LessEqual:
+                filterValues(data, value, std::less_equal<T>(), selection);
+                break;
+            case CompareOp::Greater:
+                filterValues(data, value, std::greater<T>(), selection);
+                break;
+            case CompareOp::GreaterEqual:
+                filterValues(data, value, std::greater_equal<T>(), selection);
+                break;
+            case CompareOp::Prefix:
+                break;
+        }
+    }
+
+    bool hasKernel(CompareOp op, const Value& value) const {
+        return predicateKernels().valid != nullptr && type != ColumnType::String && op != CompareOp::Prefix && !value.isNull;
+    }
+
+    // Sets one bit per row of [start, start + count) that satisfies the
+    // comparison, with nulls handled the way filter handles them. Bits past
+    // count are left undefined.
+    void compareBits(CompareOp op, const Value& value, size_t start, size_t count, uint64_t* bits) const {
+        const PredicateKernels& kernels = predicateKernels();
+        if (type == ColumnType::Int) {
+            kernels.ints[static_cast<size_t>(op)](ints.data() + start, count, value.intValue, bits);
+        } else {
+            kernels.doubles[static_cast<size_t>(op)](doubles.data() + start, count, value.doubleValue, bits);
+        }
+        uint64_t valid[kernelRows / 64];
+        kernels.valid(nulls.data() + start, count, valid);
+        for (size_t word = 0; word < (count + 63) / 64; ++word) {
+            bits[word] = op == CompareOp::NotEqual ? ~(bits[word] & valid[word]) : bits[word] & valid[word];
+        }
+    }
+
+    void filter(CompareOp op, const Value& value, std::vector<size_t>& selection) const {
+        if (value.isNull) {
+            bool wantNull = op == CompareOp::Equal;
+            bool wantValue = op == CompareOp::NotEqual;
+            size_t out = 0;
+            for (size_t row : selection) {
+                selection[out] = row;
+                out += nulls[row] ? wantNull : wantValue;
+            }
+            selection.resize(out);
+            return;
+        }
+
+        if (op == CompareOp::NotEqual) {
+            size_t out = 0;
+            for (size_t row : selection) {
+                selection[out] = row;
+                out += nulls[row] || !equals(row, value);
+            }
+            selection.resize(out);
+            return;
+        }
+
+        switch (type) {
+            case ColumnType::Int:
+                filterTyped(ints, op, value.intValue, selection);
+                break;
+            case ColumnType::Double:
+                filterTyped(doubles, op, value.doubleValue, selection);
+                break;
+            case ColumnType::String:
+                if (op == CompareOp::Prefix) {
+                    filterValues(strings, value.stringValue, [](const std::string& text, const std::string& prefix) {
+                        return keyHasPrefix(text, prefix);
+                    }, selection);
+                } else {
+                    filterTyped(strings, op, value.stringValue, selection);
+                }
+                break;
+        }
+    }
+
+    void filterIn(const std::vector<Value>& values, std::vector<size_t>& selection) const {
+        size_t out = 0;
+        for (size_t row : selection) {
+            bool found = false;
+            for (const auto& value : values) {
+                if (equals(row, value)) {
+                    found = true;
+                    break;
+                }
+            }
+            selection[out] = row;
+            out += found;
+        }
+        selection.resize(out);
+    }
+
+    uint64_t hashAt(size_t row) const {
+        if (nulls[row]) {
+            return 0x9e3779b97f4a7c15ULL;
+        }
+        uint64_t hash;
+        switch (type) {
+            case ColumnType::Int:
+                hash = static_cast<uint64_t>(ints[row]);
+                break;
+            case ColumnType::Double: {
+                double value = doubles[row] == 0 ? 0 : doubles[row];
+                std::memcpy(&hash, &value, sizeof(hash));
+                break;
+            }
+            default:
+                hash = std::hash<std::string>()(strings[row]);
+                break;
+        }
+        return mixHash(hash);
+    }
+
+    // Whether a non-null row equals a non-null row of another column of the
+    // same type.
+    bool sameValue(size_t row, const Column& other, size_t otherRow) const {
+        switch (type) {
+            case ColumnType::Int:
+                return ints[row] == other.ints[otherRow];
+            case ColumnType::Double:
+                return doubles[row] == other.doubles[otherRow];
+            default:
+                return strings[row] == other.strings[otherRow];
+        }
+    }
+
+    // Orders two rows, with nulls after every value.
+    int compareRows(size_t left, size_t right) const {
+        if (nulls[left] || nulls[right]) {
+            return nulls[left] - nulls[right];
+        }
+        switch (type) {
+            case ColumnType::Int:
+                return ints[left] < ints[right] ? -1 : (ints[right] < ints[left] ? 1 : 0);
+            case ColumnType::Double:
+                return doubles[left] < doubles[right] ? -1 : (doubles[right] < doubles[left] ? 1 : 0);
+            default:
+                return strings[left].compare(strings[right]);
+        }
+    }
+
+    // Orders a non-null row against a non-null value.
+    int compareAt(size_t row, const Value& value) const {
+        switch (type) {
+            case ColumnType::Int:
+                return ints[row] < value.intValue ? -1 : (value.intValue < ints[row] ? 1 : 0);
+            case ColumnType::Double:
+                return doubles[row] < value.doubleValue ? -1 : (value.doubleValue < doubles[row] ? 1 : 0);
+            default:
+                return strings[row].compare(value.stringValue);
+        }
+    }
+
+    bool equals(size_t row, const Value& value) const {
+        if (nulls[row] || value.isNull) {
+            return nulls[row] && value.isNull;
+        }
+        switch (type) {
+            case ColumnType::Int:
+                return ints[row] == value.intValue;
+            case ColumnType::Double:
+                return doubles[row] == value.doubleValue;
+            default:
+                return strings[row] == value.stringValue;
+        }
+    }
+
+    void appendTo(std::string& out, size_t row) const {
+        if (nulls[row]) {
+            return;
+        }
+        switch (type) {
+            case ColumnType::Int:
+                fmt::format_to(std::back_inserter(out), "{}", ints[row]);
+                break;
+            case ColumnType::Double:
+                fmt::format_to(std::back_inserter(out), "{}", doubles[row]);
+                break;
+            case ColumnType::String:
+                out += strings[row];
+                break;
+        }
+    }
+
+    void appendBinaryTo(std::string& out, size_t row) const {
+        appendBinary<uint8_t>(out, nulls[row] ? 0 : 1);
+        if (nulls[row]) {
+            return;
+        }
+        switch (type) {
+            case ColumnType::Int:
+                appendBinary<int64_t>(out, ints[row]);
+                break;
+            case ColumnType::Double:
+                appendBinary<double>(out, doubles[row]);
+                break;
+            case ColumnType::String:
+                appendBinary(out, strings[row]);
+                break;
+        }
+    }
+
+    Value valueAt(size_t row) const {
+        Value value;
+        if (nulls[row]) {
+            return value;
+        }
+        value.isNull = false;
+        switch (type) {
+            case ColumnType::Int:
+                value.intValue = ints[row];
+                break;
+            case ColumnType::Double:
+                value.doubleValue = doubles[row];
+                break;
+            case ColumnType::String:
+                value.stringValue = strings[row];
+                break;
+        }
+        return value;
+    }
+
+    std::string format(size_t row) const {
+        std::string out;
+        appendTo(out, row);
+        return out;
+    }
+
+    void compact(const std::vector<uint64_t>& tombstones, size_t rows) {
+        size_t out = 0;
+        for (size_t row = 0; row < rows; ++row) {
+            if (!(tombstones[row / 64] >> (row % 64) & 1)) {
+                if (out != row) {
+                    switch (type) {
+                        case ColumnType::Int:
+                            ints[out] = ints[row];
+                            break;
+                        case ColumnType::Double:
+                            doubles[out] = doubles[row];
+                            break;
+                        case ColumnType::String:
+                            strings[out] = std::move(strings[row]);
+                            break;
+                    }
+                    nulls[out] = nulls[row];
+                }
+                ++out;
+            }
+        }
+        resize(out);
+    }
+};
+
+// HyperLogLog distinct count over 4096 registers, about 1.6% standard error.
+class HyperLogLog {
+public:
+    void add(uint64_t hash) {
+        hash ^= hash >> 29;
+        hash *= 0xc4ceb9fe1a85ec53ULL;
+        hash ^= hash >> 32;
+        size_t index = hash >> (64 - precision);
+        uint64_t rest = hash << precision | uint64_t(1) << (precision - 1);
+        uint8_t rank = static_cast<uint8_t>(__builtin_clzll(rest) + 1);
+        registers[index] = std::max(registers[index], rank);
+    }
+
+    double estimate() const {
+        double m = static_cast<double>(registers.size());
+        double sum = 0;
+        size_t zeros = 0;
+        for (uint8_t rank : registers) {
+            sum += std::ldexp(1.0, -rank);
+            zeros += rank == 0;
+        }
+        double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+        if (estimate <= 2.5 * m && zeros != 0) {
+            estimate = m * std::log(m / static_cast<double>(zeros));
+        }
+        return estimate;
+    }
+
+private:
+    static const unsigned precision = 12;
+    std::vector<uint8_t> registers = std::vector<uint8_t>(size_t(1) << precision);
+};
+
+constexpr size_t statsSampleRows = 30000;
+constexpr size_t histogramBuckets = 64;
+
+// Collected by analyze. The histogram is equi-depth: bounds[0] is the lowest
+// sampled value and each following bound closes a bucket holding the same
+// share of the non-null values.
+struct ColumnStats {
+    size_t rows = 0;
+    size_t nulls = 0;
+    double distinct = 0;
+    Value min;
+    Value max;
+    std::vector<Value> bounds;
+
+    double nonNull() const {
+        return rows == 0 ? 0 : static_cast<double>(rows - nulls) / static_cast<double>(rows);
+    }
+
+    // Share of non-null values equal to any one value.
+    double equalShare() const {
+        return distinct < 1 ? 1 : 1 / distinct;
+    }
+
+    // Share of non-null values below value, or at most value when inclusive.
+    double shareBelow(ColumnType type, const Value& value, bool inclusive) const {
+        if (bounds.empty()) {
+            return 0;
+        }
+        if (compareValues(type, value, bounds.front()) < 0) {
+            return 0;
+        }
+        if (compareValues(type, value, bounds.back()) > 0) {
+            return 1;
+        }
+        size_t buckets = bounds.size() - 1;
+        size_t bucket = 0;
+        while (bucket + 1 < buckets && compareValues(type, bounds[bucket + 1], value) < 0) {
+            ++bucket;
+        }
+        double within = 0.5;
+        if (type != ColumnType::String) {
+            double low = type == ColumnType::Int ? static_cast<double>(bounds[bucket].intValue) : bounds[bucket].doubleValue;
+            double high = type == ColumnType::Int ? static_cast<double>(bounds[bucket + 1].intValue) : bounds[bucket + 1].doubleValue;
+            double point = type == ColumnType::Int ? static_cast<double>(value.intValue) : value.doubleValue;
+            within = high > low ? std::min(1.0, std::max(0.0, (point - low) / (high - low))) : 0.5;
+        }
+        double share = (static_cast<double>(bucket) + within) / static_cast<double>(buckets);
+        return std::min(1.0, inclusive ? share + equalShare() : share);
+    }
+};
+
+// One pass over rows for the counts, the distinct sketch and the extremes;
+// the histogram is cut from a sorted sample of every k-th row.
+ColumnStats analyzeColumn(const Column& column, const std::vector<size_t>& rows) {
+    ColumnStats stats;
+    stats.rows = rows.size();
+    HyperLogLog distinct;
+    for (size_t row : rows) {
+        if (column.nulls[row]) {
+            ++stats.nulls;
+            continue;
+        }
+        distinct.add(column.hashAt(row));
+        if (stats.min.isNull || column.compareAt(row, stats.min) < 0) {
+            stats.min = column.valueAt(row);
+        }
+        if (stats.max.isNull || column.compareAt(row, stats.max) > 0) {
+            stats.max = column.valueAt(row);
+        }
+    }
+    stats.distinct = stats.nulls == rows.size() ? 0 : std::max(1.0, std::min(distinct.estimate(), static_cast<double>(rows.size() - stats.nulls)));
+
+    std::vector<Value> sample;
+    size_t step = std::max<size_t>(1, rows.size() / statsSampleRows);
+    for (size_t i = 0; i < rows.size(); i += step) {
+        if (!column.nulls[rows[i]]) {
+            sample.push_back(column.valueAt(rows[i]));
+        }
+    }
+    ColumnType type = column.type;
+    std::sort(sample.begin(), sample.end(), [type](const Value& left, const Value& right) {
+        return compareValues(type, left, right) < 0;
+    });
+    size_t buckets = std::min(histogramBuckets, sample.size());
+    for (size_t i = 0; buckets != 0 && i <= buckets; ++i) {
+        stats.bounds.push_back(sample[i * (sample.size() - 1) / buckets]);
+    }
+    return stats;
+}
+
+struct BoundAssignment {
+    size_t column;
+    Value value;
+};
+
+struct HashIndex {
+    size_t column;
+    std::unordered_map<Value, std::vector<size_t>, ValueHash> buckets;
+
+    void insert(const Value& key, size_t row) {
+        buckets[key].push_back(row);
+    }
+
+    void erase(const Value& key, size_t row) {
+        auto bucketIt = buckets.find(key);
+        if (bucketIt == buckets.end()) {
+            return;
+        }
+        auto& rows = bucketIt->second;
+        rows.erase(std::remove(rows.begin(), rows.end(), row), rows.end());
+        if (rows.empty()) {
+            buckets.erase(bucketIt);
+        }
+    }
+
+    const std::vector<size_t>* find(const Value& key) const {
+        auto bucketIt = buckets.find(key);
+        return bucketIt != buckets.end() ? &bucketIt->second : nullptr;
+    }
+};
+
+const uint64_t liveVersion = UINT64_MAX;
+const uint64_t latestVersion = liveVersion - 1;
+
+enum class AggregateKind {
+    Count,
+    Sum,
+    Avg,
+    Min,
+    Max
+};
+
+struct BoundAggregate {
+    AggregateKind kind;
+    size_t column;
+    std::string label;
+};
+
+struct BoundStatement {
+    // For aggregate queries, the columns the scan reads.
+    std::vector<size_t> projection;
+    std::unique_ptr<Expr> where;
+    std::vector<BoundAssignment> assignments;
+    std::vector<size_t> groupBy;
+    std::vector<BoundAggregate> aggregates;
+    // Result columns of an aggregate query in select order: indexes into
+    // groupBy, then into aggregates offset by groupBy.size().
+    std::vector<size_t> output;
+    // The order by column: a table column, or for aggregate queries an
+    // index into output.
+    size_t orderBy = invalidColumn;
+    bool descending = false;
+    size_t limit = noLimit;
+    size_t offset = 0;
+    uint64_t snapshot = latestVersion;
+
+    bool isAggregate() const {
+        return !groupBy.empty() || !aggregates.empty();
+    }
+
+    bool isOrdered() const {
+        return orderBy != invalidColumn || limit != noLimit || offset != 0;
+    }
+
+    // Rows a scan has to produce before offset and limit are applied.
+    size_t wantedRows() const {
+        return limit == noLimit || limit > noLimit - offset ? noLimit : offset + limit;
+    }
+};
+
+// Int sums are checked for overflow; doubleSum also runs over int columns so
+// that avg stays defined when intSum overflows.
+struct AggregateState {
+    int64_t count = 0;
+    int64_t intSum = 0;
+    bool overflow = false;
+    double doubleSum = 0;
+    Value min;
+    Value max;
+};
+
+// Hash aggregation for group by. Slots are probed linearly and hold only part
+// of the hash and a group number; group keys and aggregate states sit in flat
+// arrays by group number, in the order the groups were first seen. Scan slots
+// each fill their own table and merge it into the result.
+class GroupTable {
+public:
+    GroupTable(const std::vector<Column>& tableColumns, const BoundStatement& bound) : columns(&tableColumns), statement(&bound) {
+        clear();
+    }
+
+    size_t size() const {
+        return hashes.size();
+    }
+
+    void add(size_t row) {
+        uint64_t hash = 0;
+        for (size_t column : statement->groupBy) {
+            hash = (hash ^ (*columns)[column].hashAt(row)) * 0x100000001b3ULL;
+        }
+        size_t group = find(hash, [this, row](size_t candidate) {
+            const Value* key = &keys[candidate * statement->groupBy.size()];
+            for (size_t i = 0; i < statement->groupBy.size(); ++i) {
+                if (!(*columns)[statement->groupBy[i]].equals(row, key[i])) {
+                    return false;
+                }
+            }
+            return true;
+        });
+        if (group == noGroup) {
+            group = insert(hash);
+            for (size_t column : statement->groupBy) {
+                keys.push_back((*columns)[column].valueAt(row));
+            }
+        }
+
+        AggregateState* state = &states[group * statement->aggregates.size()];
+        for (size_t i = 0; i < statement->aggregates.size(); ++i) {
+            accumulate(state[i], statement->aggregates[i], row);
+        }
+    }
+
+    void merge(const GroupTable& other) {
+        size_t keyCount = statement->groupBy.size();
+        size_t aggregateCount = statement->aggregates.size();
+        for (size_t source = 0; source < other.size(); ++source) {
+            const Value* key = &other.keys[source * keyCount];
+            size_t group = find(other.hashes[source], [this, key, keyCount](size_t candidate) {
+                return std::equal(key, key + keyCount, keys.begin() + candidate * keyCount);
+            });
+            if (group == noGroup) {
+                group = insert(other.hashes[source]);
+                keys.insert(keys.end(), key, key + keyCount);
+            }
+            for (size_t i = 0; i < aggregateCount; ++i) {
+                combine(states[group * aggregateCount + i], other.states[source * aggregateCount + i], statement->aggregates[i]);
+            }
+        }
+    }
+
+    void clear() {
+        slots.assign(16, Slot{0, 0});
+        hashes.clear();
+        keys.clear();
+        states.clear();
+    }
+
+    // Builds one result column per output item. Without group by there is
+    // always a single row, even when no row matched.
+    // Fails when an int sum overflowed.
+    bool finish(std::vector<Column>& result) const {
+        size_t keyCount = statement->groupBy.size();
+        size_t aggregateCount = statement->aggregates.size();
+        for (size_t item : statement->output) {
+            Column column;
+            if (item < keyCount) {
+                column.name = (*columns)[statement->groupBy[item]].name;
+                column.type = (*columns)[statement->groupBy[item]].type;
+            } else {
+                column.name = statement->aggregates[item - keyCount].label;
+                column.type = resultType(statement->aggregates[item - keyCount]);
+            }
+            result.push_back(std::move(column));
+        }
+
+        std::vector<AggregateState> empty(aggregateCount);
+        size_t groups = keyCount == 0 && size() == 0 ? 1 : size();
+        for (size_t group = 0; group < groups; ++group) {
+            const AggregateState* state = size() == 0 ? empty.data() : &states[group * aggregateCount];
+            for (size_t i = 0; i < statement->output.size(); ++i) {
+                size_t item = statement->output[i];
+                if (item < keyCount) {
+                    result[i].append(keys[group * keyCount + item]);
+                    continue;
+                }
+                const BoundAggregate& aggregate = statement->aggregates[item - keyCount];
+                if (aggregate.kind == AggregateKind::Sum && state[item - keyCount].overflow) {
+                    report("Error: Integer overflow in {}\n", aggregate.label);
+                    return false;
+                }
+                result[i].append(resultValue(state[item - keyCount], aggregate));
+            }
+        }
+        return true;
+    }
+
+private:
+    struct Slot {
+        uint32_t tag;
+        uint32_t group;
+    };
+
+    static const size_t noGroup = static_cast<size_t>(-1);
+
+    const std::vector<Column>* columns;
+    const BoundStatement* statement;
+    std::vector<Slot> slots;
+    std::vector<uint64_t> hashes;
+    std::vector<Value> keys;
+    std::vector<AggregateState> states;
+
+    // Slot groups are stored plus one so that zero marks an empty slot.
+    template <typename Matches>
+    size_t find(uint64_t hash, Matches matches) const {
+        size_t mask = slots.size() - 1;
+        uint32_t tag = static_cast<uint32_t>(hash >> 32);
+        for (size_t i = hash & mask; slots[i].group != 0; i = (i + 1) & mask) {
+            if (slots[i].tag == tag && matches(slots[i].group - 1)) {
+                return slots[i].group - 1;
+            }
+        }
+        return noGroup;
+    }
+
+    size_t insert(uint64_t hash) {
+        if ((hashes.size() + 1) * 2 > slots.size()) {
+            slots.assign(slots.size() * 2, Slot{0, 0});
+            for (size_t group = 0; group < hashes.size(); ++group) {
+                place(hashes[group], group);
+            }
+        }
+        size_t group = hashes.size();
+        place(hash, group);
+        hashes.push_back(hash);
+        states.resize(states.size() + statement->aggregates.size());
+        return group;
+    }
+
+    void place(uint64_t hash, size_t group) {
+        size_t mask = slots.size() - 1;
+        size_t i = hash & mask;
+        while (slots[i].group != 0) {
+            i = (i + 1) & mask;
+        }
+        slots[i] = Slot{static_cast<uint32_t>(hash >> 32), static_cast<uint32_t>(group + 1)};
+    }
+
+    void accumulate(AggregateState& state, const BoundAggregate& aggregate, size_t row) const {
+        if (aggregate.column == invalidColumn) {
+            ++state.count;
+            return;
+        }
+        const Column& column = (*columns)[aggregate.column];
+        if (column.nulls[row]) {
+            return;
+        }
+        ++state.count;
+        switch (aggregate.kind) {
+            case AggregateKind::Sum:
+            case AggregateKind::Avg:
+                if (column.type == ColumnType::Int) {
+                    state.overflow |= __builtin_add_overflow(state.intSum, column.ints[row], &state.intSum);
+                    state.doubleSum += static_cast<double>(column.ints[row]);
+                } else {
+                    state.doubleSum += column.doubles[row];
+                }
+                break;
+            case AggregateKind::Min:
+                if (state.min.isNull || column.compareAt(row, state.min) < 0) {
+                    state.min = column.valueAt(row);
+                }
+                break;
+            case AggregateKind::Max:
+                if (state.max.isNull || column.compareAt(row, state.max) > 0) {
+                    state.max = column.valueAt(row);
+                }
+                break;
+            case AggregateKind::Count:
+                break;
+        }
+    }
+
+    void combine(AggregateState& state, const AggregateState& other, const BoundAggregate& aggregate) const {
+        state.count += other.count;
+        state.overflow |= other.overflow || __builtin_add_overflow(state.intSum, other.intSum, &state.intSum);
+        state.doubleSum += other.doubleSum;
+        if (aggregate.column == invalidColumn) {
+            return;
+        }
+        ColumnType type = (*columns)[aggregate.column].type;
+        if (!other.min.isNull && (state.min.isNull || compareValues(type, other.min, state.min) < 0)) {
+            state.min = other.min;
+        }
+        if (!other.max.isNull && (state.max.isNull || compareValues(type, other.max, state.max) > 0)) {
+            state.max = other.max;
+        }
+    }
+
+    ColumnType resultType(const BoundAggregate& aggregate) const {
+        switch (aggregate.kind) {
+            case AggregateKind::Count:
+                return ColumnType::Int;
+            case AggregateKind::Avg:
+                return ColumnType::Double;
+            default:
+                return (*columns)[aggregate.column].type;
+        }
+    }
+
+    Value resultValue(const AggregateState& state, const BoundAggregate& aggregate) const {
+        Value value;
+        if (aggregate.kind != AggregateKind::Count && state.count == 0) {
+            return value;
+        }
+        value.isNull = false;
+        bool ints = aggregate.column != invalidColumn && (*columns)[aggregate.column].type == ColumnType::Int;
+        switch (aggregate.kind) {
+            case AggregateKind::Count:
+                value.intValue = state.count;
+                break;
+            case AggregateKind::Sum:
+                value.intValue = state.intSum;
+                value.doubleValue = state.doubleSum;
+                break;
+            case AggregateKind::Avg:
+                value.doubleValue = (ints && !state.overflow ? static_cast<double>(state.intSum) : state.doubleSum) / static_cast<double>(state.count);
+                break;
+            case AggregateKind::Min:
+                return state.min;
+            case AggregateKind::Max:
+                return state.max;
+        }
+        return value;
+    }
+};
+
+// The first count rows by one column, ties kept in row order. A bounded heap
+// holds the rows kept so far with the last of them on top, so each row costs
+// at most a log count push once the heap is full. Without a bound the rows
+// are simply sorted at the end. The key column is looked up by ordinal on
+// every compare, since a scan that yields its latch can see addColumn move
+// the table's columns.
+class TopRows {
+public:
+    TopRows(const std::vector<Column>& tableColumns, size_t keyColumn, bool descendingOrder, size_t rowCount) : columns(&tableColumns), key(keyColumn), descending(descendingOrder), count(rowCount) {}
+
+    void add(size_t row) {
+        auto order = [this](size_t left, size_t right) {
+            return before(left, right);
+        };
+        if (count == noLimit) {
+            rows.push_back(row);
+        } else if (rows.size() < count) {
+            rows.push_back(row);
+            std::push_heap(rows.begin(), rows.end(), order);
+        } else if (count != 0 && before(row, rows.front())) {
+            std::pop_heap(rows.begin(), rows.end(), order);
+            rows.back() = row;
+            std::push_heap(rows.begin(), rows.end(), order);
+        }
+    }
+
+    void merge(TopRows& other) {
+        for (size_t row : other.rows) {
+            add(row);
+        }
+        other.rows.clear();
+    }
+
+    std::vector<size_t> finish() {
+        auto order = [this](size_t left, size_t right) {
+            return before(left, right);
+        };
+        if (count == noLimit) {
+            std::sort(rows.begin(), rows.end(), order);
+        } else {
+            std::sort_heap(rows.begin(), rows.end(), order);
+        }
+        return std::move(rows);
+    }
+
+private:
+    const std::vector<Column>* columns;
+    size_t key;
+    bool descending;
+    size_t count;
+    std::vector<size_t> rows;
+
+    bool before(size_t left, size_t right) const {
+        int order = (*columns)[key].compareRows(left, right);
+        if (order != 0) {
+            return descending ? order > 0 : order < 0;
+        }
+        return left < right;
+    }
+};
+
+// Rows of a join's build side per key. Rows are spread over partitions by
+// the top bits of their key hash, so that each partition's slots and chains
+// stay about cache-sized however large the build side grows, and the
+// partitions are built in parallel. Rows with equal keys are chained in row
+// order; null keys never match.
+class JoinTable {
+public:
+    JoinTable(const Column& keyColumn, const std::vector<size_t>& rows, Scheduler& scheduler) : key(&keyColumn) {
+        while ((rows.size() >> bits) > joinPartitionRows) {
+            ++bits;
+        }
+        partitions.resize(size_t(1) << bits);
+
+        std::vector<uint64_t> hashes(rows.size());
+        std::vector<size_t> counts(partitions.size());
+        for (size_t i = 0; i < rows.size(); ++i) {
+            hashes[i] = key->hashAt(rows[i]);
+            counts[partitionOf(hashes[i])] += !key->nulls[rows[i]];
+        }
+        for (size_t i = 0; i < partitions.size(); ++i) {
+            partitions[i].rows.reserve(counts[i]);
+            partitions[i].hashes.reserve(counts[i]);
+        }
+        for (size_t i = 0; i < rows.size(); ++i) {
+            if (!key->nulls[rows[i]]) {
+                Partition& partition = partitions[partitionOf(hashes[i])];
+                partition.rows.push_back(rows[i]);
+                partition.hashes.push_back(hashes[i]);
+            }
+        }
+
+        scheduler.parallelFor(partitions.size(), [this](size_t i) {
+            build(partitions[i]);
+        });
+    }
+
+    // Calls emit with every build row whose key equals the key of row in
+    // probeKey.
+    template <typename Emit>
+    void probe(const Column& probeKey, size_t row, Emit emit) const {
+        if (probeKey.nulls[row]) {
+            return;
+        }
+        uint64_t hash = probeKey.hashAt(row);
+        const Partition& partition = partitions[partitionOf(hash)];
+        size_t mask = partition.slots.size() - 1;
+        uint32_t tag = static_cast<uint32_t>(hash >> 32);
+        for (size_t i = hash & mask; partition.slots[i].head != 0; i = (i + 1) & mask) {
+            uint32_t entry = partition.slots[i].head;
+            if (partition.slots[i].tag == tag && probeKey.sameValue(row, *key, partition.rows[entry - 1])) {
+                for (; entry != 0; entry = partition.next[entry - 1]) {
+                    emit(partition.rows[entry - 1]);
+                }
+                return;
+            }
+        }
+    }
+
+private:
+    // Heads and links are entry numbers plus one, zero marking the end.
+    struct Slot {
+        uint32_t tag;
+        uint32_t head;
+    };
+
+    struct Partition {
+        std::vector<size_t> rows;
+        std::vector<uint64_t> hashes;
+        std::vector<uint32_t> next;
+        std::vector<Slot> slots;
+    };
+
+    const Column* key;
+    unsigned bits = 0;
+    std::vector<Partition> partitions;
+
+    size_t partitionOf(uint64_t hash) const {
+        return bits == 0 ? 0 : static_cast<size_t>(hash >> (64 - bits));
+    }
+
+    // Entries are inserted last to first so that each chain, built by
+    // prepending, ends up in row order.
+    void build(Partition& partition) const {
+        size_t capacity = 16;
+        while (capacity < partition.rows.size() * 2) {
+            capacity *= 2;
+        }
+        partition.slots.assign(capacity, Slot{0, 0});
+        partition.next.assign(partition.rows.size(), 0);
+        size_t mask = capacity - 1;
+        for (size_t entry = partition.rows.size(); entry-- > 0;) {
+            uint64_t hash = partition.hashes[entry];
+            uint32_t tag = static_cast<uint32_t>(hash >> 32);
+            size_t i = hash & mask;
+            while (partition.slots[i].head != 0 &&
+                   (partition.slots[i].tag != tag || !key->sameValue(partition.rows[entry], *key, partition.rows[partition.slots[i].head - 1]))) {
+                i = (i + 1) & mask;
+            }
+            partition.next[entry] = partition.slots[i].head;
+            partition.slots[i] = Slot{tag, static_cast<uint32_t>(entry + 1)};
+        }
+        partition.hashes.clear();
+        partition.hashes.shrink_to_fit();
+    }
+};
+
+const char snapshotMagic[8] = {'S', 'D', 'B', 'S', 'N', 'A', 'P', '1'};
+const uint32_t snapshotVersion = 1;
+const size_t snapshotHeaderSize = 16;
+const size_t snapshotTrailerSize = 40;
+const char chunkMagic[8] = {'S', 'D', 'B', 'C', 'H', 'N', 'K', '1'};
+const char manifestMagic[8] = {'S', 'D', 'B', 'M', 'A', 'N', 'I', '1'};
+const char manifestName[] = "MANIFEST";
+const size_t checkpointChunkRows = 65536;
+
+struct BinaryWriter {
+    std::FILE* file;
+    uint64_t offset = 0;
+    Checksum* checksum = nullptr;
+    bool ok = true;
+
+    explicit BinaryWriter(std::FILE* output) : file(output) {}
+
+    void write(const void* data, size_t size) {
+        if (size == 0) {
+            return;
+        }
+        if (std::fwrite(data, 1, size, file) != size) {
+            ok = false;
+        }
+        if (checksum != nullptr) {
+            checksum->update(data, size);
+        }
+        offset += size;
+    }
+
+    template <typename T>
+    void writeValue(T value) {
+        write(&value, sizeof(T));
+    }
+
+    void align() {
+        static const char zeros[8] = {};
+        write(zeros, (8 - offset % 8) % 8);
+    }
+};
+
+struct ByteReader {
+    const char* pos;
+    const char* end;
+    bool ok = true;
+
+    ByteReader(const char* begin, const char* limit) : pos(begin), end(limit) {}
+
+    template <typename T>
+    T read() {
+        T value{};
+        if (static_cast<size_t>(end - pos) < sizeof(T)) {
+            ok = false;
+            return value;
+        }
+        std::memcpy(&value, pos, sizeof(T));
+        pos += sizeof(T);
+        return value;
+    }
+
+    std::string readString() {
+        uint32_t length = read<uint32_t>();
+        if (!ok || static_cast<size_t>(end - pos) < length) {
+            ok = false;
+            return std::string();
+        }
+        std::string text(pos, length);
+        pos += length;
+        return text;
+    }
+};
+
+enum class LogRecordType : uint8_t {
+    CreateTable = 1,
+    AddColumn,
+    CreateIndex,
+    Insert,
+    Update,
+    Delete,
+    Load,
+    Batch,
+    Shard
+};
+
+void appendExpr(std::string& out, const Expr* expr) {
+    appendBinary<uint8_t>(out, expr != nullptr);
+    if (expr == nullptr) {
+        return;
+    }
+    appendBinary<uint8_t>(out, static_cast<uint8_t>(expr->kind));
+    appendBinary<uint8_t>(out, static_cast<uint8_t>(expr->op));
+    appendBinary(out, expr->columnName);
+    appendBinary<uint32_t>(out, static_cast<uint32_t>(expr->literals.size()));
+    for (const auto& literal : expr->literals) {
+        appendBinary(out, literal);
+    }
+    appendBinary<uint32_t>(out, static_cast<uint32_t>(expr->children.size()));
+    for (const auto& child : expr->children) {
+        appendExpr(out, child.get());
+    }
+}
+
+bool readExpr(ByteReader& reader, std::unique_ptr<Expr>& expr, int depth = 0) {
+    expr.reset();
+    if (reader.read<uint8_t>() == 0 || !reader.ok) {
+        return reader.ok;
+    }
+    uint8_t kind = reader.read<uint8_t>();
+    uint8_t op = reader.read<uint8_t>();
+    if (kind > static_cast<uint8_t>(ExprKind::Not) || op > static_cast<uint8_t>(CompareOp::Prefix) || depth > 1000) {
+        return false;
+    }
+    expr.reset(new Expr(static_cast<ExprKind>(kind)));
+    expr->op = static_cast<CompareOp>(op);
+    expr->columnName = reader.readString();
+    uint32_t literalCount = reader.read<uint32_t>();
+    for (uint32_t i = 0; i < literalCount && reader.ok; ++i) {
+        expr->literals.push_back(reader.readString());
+    }
+    uint32_t childCount = reader.read<uint32_t>();
+    for (uint32_t i = 0; i < childCount && reader.ok; ++i) {
+        expr->children.emplace_back();
+        if (!readExpr(reader, expr->children.back(), depth + 1) || expr->children.back() == nullptr) {
+            return false;
+        }
+    }
+    return reader.ok;
+}
+
+enum class FrameType : uint8_t {
+    Command = 1,
+    Message = 2,
+    Error = 3,
+    Columns = 4,
+    Rows = 5,
+    Done = 6
+};
+
+const size_t maxFrameSize = 64 << 20;
+const size_t rowsFrameSize = 64 << 10;
+
+// Replies on the binary protocol. Every frame is a u32 length covering the
+// rest of the frame, the u32 id of the statement it answers, a FrameType and
+// its payload; rows are batched into frames of about rowsFrameSize bytes.
+struct FrameWriter {
+    std::string& out;
+    uint32_t statement;
+    size_t rowsStart = std::string::npos;
+    uint32_t rowCount = 0;
+
+    FrameWriter(std::string& output, uint32_t id) : out(output), statement(id) {}
+
+    size_t begin(FrameType type) {
+        size_t start = out.size();
+        appendBinary<uint32_t>(out, 0);
+        appendBinary<uint32_t>(out, statement);
+        appendBinary<uint8_t>(out, static_cast<uint8_t>(type));
+        return start;
+    }
+
+    void finish(size_t start) {
+        uint32_t length = static_cast<uint32_t>(out.size() - start - sizeof(uint32_t));
+        std::memcpy(&out[start], &length, sizeof(length));
+    }
+
+    void message(FrameType type, const std::string& text) {
+        size_t start = begin(type);
+        appendBinary(out, text);
+        finish(start);
+    }
+
+    void columns(const std::vector<Column>& tableColumns, const std::vector<size_t>& projection) {
+        size_t start = begin(FrameType::Columns);
+        appendBinary<uint16_t>(out, static_cast<uint16_t>(projection.size()));
+        for (size_t column : projection) {
+            appendBinary<uint8_t>(out, static_cast<uint8_t>(tableColumns[column].type));
+            appendBinary(out, tableColumns[column].name);
+        }
+        finish(start);
+    }
+
+    void row(const std::vector<Column>& tableColumns, const std::vector<size_t>& projection, size_t row) {
+        beginRow();
+        for (size_t column : projection) {
+            tableColumns[column].appendBinaryTo(out, row);
+        }
+        endRow();
+    }
+
+    // A row whose values were encoded elsewhere, by another FrameWriter's
+    // row with the same projection.
+    void encodedRow(const std::string& values) {
+        beginRow();
+        out += values;
+        endRow();
+    }
+
+    void beginRow() {
+        if (rowsStart == std::string::npos) {
+            rowsStart = begin(FrameType::Rows);
+            appendBinary<uint32_t>(out, 0);
+        }
+    }
+
+    void endRow() {
+        ++rowCount;
+        if (out.size() - rowsStart >= rowsFrameSize) {
+            flushRows();
+        }
+    }
+
+    void flushRows() {
+        if (rowsStart == std::string::npos) {
+            return;
+        }
+        std::memcpy(&out[rowsStart + 9], &rowCount, sizeof(rowCount));
+        finish(rowsStart);
+        rowsStart = std::string::npos;
+        rowCount = 0;
+    }
+
+    void append(const std::string& frames) {
+        flushRows();
+        out += frames;
+    }
+
+    void done() {
+        flushRows();
+        finish(begin(FrameType::Done));
+    }
+};
+
+void writeMessageFrame(FrameWriter& frames, const std::string& text) {
+    std::string message = text;
+    if (!message.empty() && message.back() == '\n') {
+        message.pop_back();
+    }
+    const std::string errorPrefix = "Error: ";
+    if (message.compare(0, errorPrefix.size(), errorPrefix) == 0) {
+        frames.message(FrameType::Error, message.substr(errorPrefix.size()));
+    } else {
+        frames.message(FrameType::Message, message);
+    }
+}
+
+struct WriteStatement {
+    LogRecordType type;
+    std::string table;
+    std::map<std::string, std::string> values;
+    std::unique_ptr<Expr> where;
+};
+
+struct QueryStatement {
+    std::string table;
+    std::vector<std::string> select;
+    std::unique_ptr<Expr> where;
+    std::vector<std::string> groupBy;
+    std::string orderBy;
+    bool descending = false;
+    size_t limit = noLimit;
+    size_t offset = 0;
+    // join <table> on <column>=<column>, the first column from this table.
+    std::string join;
+    std::string joinLeft;
+    std::string joinRight;
+};
+
+bool syncDirectory(const std::string& directory) {
+    int fd = open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return false;
+    }
+    bool synced = fsync(fd) == 0;
+    return close(fd) == 0 && synced;
+}
+
+// The directory part of path, empty for a bare file name.
+std::string parentDirectory(const std::string& path) {
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? std::string() : path.substr(0, slash == 0 ? 1 : slash);
+}
+
+bool writeAll(int fd, const char* data, size_t size) {
+    for (size_t offset = 0; offset < size;) {
+        ssize_t count = write(fd, data + offset, size - offset);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        offset += static_cast<size_t>(count);
+    }
+    return true;
+}
+
+// Hard-links from to to, or copies it where links are not possible.
+bool linkOrCopy(const std::string& from, const std::string& to) {
+    if (link(from.c_str(), to.c_str()) == 0) {
+        int fd = open(to.c_str(), O_RDONLY);
+        bool synced = fd >= 0 && fsync(fd) == 0;
+        return (fd < 0 || close(fd) == 0) && synced;
+    }
+    if (errno != EXDEV && errno != EPERM && errno != EMLINK) {
+        return false;
+    }
+    int in = open(from.c_str(), O_RDONLY);
+    if (in < 0) {
+        return false;
+    }
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    bool copied = out >= 0;
+    std::vector<char> buffer(1 << 20);
+    while (copied) {
+        ssize_t count = read(in, buffer.data(), buffer.size());
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            copied = count == 0;
+            break;
+        }
+        copied = writeAll(out, buffer.data(), static_cast<size_t>(count));
+    }
+    copied = copied && fsync(out) == 0;
+    close(in);
+    if (out >= 0) {
+        copied = close(out) == 0 && copied;
+    }
+    return copied;
+}
+
+// Removes a file, or a directory of files.
+void removePath(const std::string& path) {
+    DIR* listing = opendir(path.c_str());
+    if (listing == nullptr) {
+        std::remove(path.c_str());
+        return;
+    }
+    while (dirent* item = readdir(listing)) {
+        std::string fileName = item->d_name;
+        if (fileName != "." && fileName != "..") {
+            std::remove((path + "/" + fileName).c_str());
+        }
+    }
+    closedir(listing);
+    rmdir(path.c_str());
+}
+
+class WriteAheadLog {
+private:
+    static const size_t frameHeaderSize = 12;
+
+    std::string path;
+    int fd = -1;
+    std::mutex mutex;
+    std::condition_variable flushedCondition;
+    std::string pending;
+    // Positions count the bytes appended since open; position p is at file
+    // offset p + origin.
+    int64_t origin = 0;
+    uint64_t appendedLsn = 0;
+    uint64_t durableLsn = 0;
+    bool flushing = false;
+    bool failed = false;
+
+    static void appendFrame(std::string& out, const std::string& record) {
+        Checksum checksum;
+        checksum.update(record.data(), record.size());
+        appendBinary<uint32_t>(out, static_cast<uint32_t>(record.size()));
+        appendBinary<uint64_t>(out, checksum.finish());
+        out += record;
+    }
+
+public:
+    WriteAheadLog() {}
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    ~WriteAheadLog() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    // Calls visit(payload, length, offset) for each intact frame of contents
+    // until one is torn or visit returns false, and returns the offset where
+    // it stopped.
+    template <typename Visit>
+    static size_t frames(const std::string& contents, Visit visit) {
+        size_t offset = 0;
+        while (contents.size() - offset >= frameHeaderSize) {
+            uint32_t length;
+            uint64_t expected;
+            std::memcpy(&length, contents.data() + offset, 4);
+            std::memcpy(&expected, contents.data() + offset + 4, 8);
+            if (contents.size() - offset - frameHeaderSize < length) {
+                break;
+            }
+            const char* payload = contents.data() + offset + frameHeaderSize;
+            Checksum checksum;
+            checksum.update(payload, length);
+            if (checksum.finish() != expected || !visit(payload, static_cast<size_t>(length), offset)) {
+                break;
+            }
+            offset += frameHeaderSize + length;
+        }
+        return offset;
+    }
+
+    template <typename Apply>
+    static bool replay(const std::string& path, Apply apply) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            return true;
+        }
+        std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        file.close();
+
+        bool applied = true;
+        size_t offset = frames(contents, [&apply, &applied](const char* payload, size_t length, size_t at) {
+            if (!apply(payload, length)) {
+                report("Error: Unable to apply write-ahead log record at offset {}\n", at);
+                applied = false;
+            }
+            return applied;
+        });
+        if (!applied) {
+            return false;
+        }
+
+        if (offset != contents.size()) {
+            report("Warning: Discarding {} bytes of incomplete write-ahead log tail\n", contents.size() - offset);
+            if (truncate(path.c_str(), static_cast<off_t>(offset)) != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool open(const std::string& logPath) {
+        path = logPath;
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            return false;
+        }
+        origin = info.st_size;
+        return true;
+    }
+
+    const std::string& filePath() const {
+        return path;
+    }
+
+    uint64_t position() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return appendedLsn;
+    }
+
+    uint64_t append(const std::string& record) {
+        std::lock_guard<std::mutex> lock(mutex);
+        appendFrame(pending, record);
+        appendedLsn += frameHeaderSize + record.size();
+        return appendedLsn;
+    }
+
+    // Atomically replaces the log with the head records followed by the
+    // records after position from, which must be durable. kept receives the
+    // contents of the new log. Appends wait until the new log is in place.
+    bool rewrite(const std::vector<std::string>& head, uint64_t from, std::string& kept) {
+        std::unique_lock<std::mutex> lock(mutex);
+        flushedCondition.wait(lock, [this] {
+            return !flushing;
+        });
+        if (failed || from > durableLsn) {
+            return false;
+        }
+
+        kept.clear();
+        for (const auto& record : head) {
+            appendFrame(kept, record);
+        }
+        size_t headSize = kept.size();
+        kept.resize(headSize + (durableLsn - from));
+        int in = ::open(path.c_str(), O_RDONLY);
+        bool copied = in >= 0;
+        for (size_t done = headSize; copied && done < kept.size();) {
+            ssize_t count = pread(in, &kept[done], kept.size() - done, static_cast<off_t>(from + origin + (done - headSize)));
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            copied = count > 0;
+            done += copied ? static_cast<size_t>(count) : 0;
+        }
+        if (in >= 0) {
+            close(in);
+        }
+
+        std::string tempName = path + ".tmp";
+        int out = copied ? ::open(tempName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+        bool written = out >= 0 && writeAll(out, kept.data(), kept.size()) && fsync(out) == 0;
+        written = (out < 0 || close(out) == 0) && written;
+        if (!written || std::rename(tempName.c_str(), path.c_str()) != 0) {
+            std::remove(tempName.c_str());
+            return false;
+        }
+        int reopened = ::open(path.c_str(), O_WRONLY | O_APPEND);
+        if (reopened < 0 || !syncDirectory(parentDirectory(path))) {
+            failed = true;
+            if (reopened >= 0) {
+                close(reopened);
+            }
+            return false;
+        }
+        close(fd);
+        fd = reopened;
+        origin = static_cast<int64_t>(headSize) - static_cast<int64_t>(from);
+        return true;
+    }
+
+    bool commit(uint64_t lsn) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (durableLsn < lsn && !failed) {
+            if (flushing) {
+                flushedCondition.wait(lock);
+                continue;
+            }
+
+            flushing = true;
+            std::string batch;
+            batch.swap(pending);
+            uint64_t batchLsn = appendedLsn;
+            lock.unlock();
+
+            bool written = writeAll(fd, batch.data(), batch.size()) && fsync(fd) == 0;
+
+            lock.lock();
+            flushing = false;
+            if (written) {
+                durableLsn = batchLsn;
+            } else {
+                failed = true;
+            }
+            flushedCondition.notify_all();
+        }
+        return durableLsn >= lsn;
+    }
+};
+
+struct CheckpointProgress {
+    std::atomic<uint64_t> written{0};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> elapsed{0};
+};
+
+enum class CheckpointKind {
+    Text,
+    Snapshot,
+    Incremental
+};
+
+struct ChunkWrite {
+    std::string table;
+    size_t chunk;
+};
+
+// Reader/writer latch that lets a waiting writer in before new readers, so
+// scans that keep re-acquiring it between batches cannot starve writers.
+class SharedLatch {
+    std::mutex mutex;
+    std::condition_variable readerGate;
+    std::condition_variable writerGate;
+    size_t readers = 0;
+    size_t waitingWriters = 0;
+    bool writer = false;
+
+public:
+    void lock() {
+        std::unique_lock<std::mutex> guard(mutex);
+        ++waitingWriters;
+        writerGate.wait(guard, [this] {
+            return !writer && readers == 0;
+        });
+        --waitingWriters;
+        writer = true;
+    }
+
+    void unlock() {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            writer = false;
+        }
+        writerGate.notify_one();
+        readerGate.notify_all();
+    }
+
+    void lock_shared() {
+        std::unique_lock<std::mutex> guard(mutex);
+        readerGate.wait(guard, [this] {
+            return !writer && waitingWriters == 0;
+        });
+        ++readers;
+    }
+
+    void unlock_shared() {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (--readers == 0 && waitingWriters != 0) {
+            writerGate.notify_one();
+        }
+    }
+};
+
+using SharedLock = std::shared_lock<SharedLatch>;
+using ExclusiveLock = std::unique_lock<SharedLatch>;
+
+struct TableLatch {
+    SharedLatch lock;
+    std::mutex writerLock;
+    std::atomic<size_t> scans{0};
+};
+
+class SimpleDatabase;
+
+struct Table {
+    friend class SimpleDatabase;
+
+private:
+    std::string name;
+    std::vector<Column> columns;
+    std::vector<HashIndex> indexes;
+    std::vector<std::unique_ptr<OrderedIndex>> orderedIndexes;
+    std::vector<uint64_t> tombstones;
+    size_t rowCount = 0;
+    size_t deletedCount = 0;
+    std::string checkpointDirectory;
+    std::vector<std::string> chunkFiles;
+    std::vector<uint8_t> dirtyChunks;
+    std::vector<uint64_t> beginVersions;
+    std::vector<uint64_t> endVersions;
+    // Set by analyze; empty until then.
+    std::vector<ColumnStats> columnStats;
+    std::unique_ptr<TableLatch> latch{new TableLatch()};
+
+    void markDirty(size_t row) {
+        size_t chunk = row / checkpointChunkRows;
+        if (chunk >= dirtyChunks.size()) {
+            dirtyChunks.resize(chunk + 1, 1);
+        }
+        dirtyChunks[chunk] = 1;
+    }
+
+    // Also accepts the name qualified with the table's, as in Employees.ID.
+    size_t findColumn(const std::string& columnName) const {
+        for (size_t i = 0; i < columns.size(); ++i) {
+            if (columns[i].name == columnName) {
+                return i;
+            }
+        }
+        if (columnName.size() > name.size() + 1 && columnName.compare(0, name.size(), name) == 0 && columnName[name.size()] == '.') {
+            return findColumn(columnName.substr(name.size() + 1));
+        }
+        return invalidColumn;
+    }
+
+    bool bindValue(size_t column, const std::string& text, Value& value) const {
+        if (!parseValue(columns[column].type, text, value)) {
+            report("Error: Invalid {} value {} for column {}\n", columnTypeName(columns[column].type), text, columns[column].name);
+            return false;
+        }
+        return true;
+    }
+
+public:
+    Table() {}
+
+    Table(const std::string& tableName, const std::vector<Column>& tableColumns) : name(tableName), columns(tableColumns) {}
+
+    Table(Table&&) = default;
+    Table& operator=(Table&&) = default;
+
+    void addColumn(const Column& newColumn) {
+        columns.push_back(newColumn);
+        columns.back().resize(rowCount);
+        checkpointDirectory.clear();
+    }
+
+    bool bindRow(const std::map<std::string, std::string>& data, std::vector<Value>& newRow) const {
+        newRow.assign(columns.size(), Value());
+        for (const auto& entry : data) {
+            size_t column = findColumn(entry.first);
+            if (column == invalidColumn) {
+                report("Error: Column {} not found in table {}\n", entry.first, name);
+                return false;
+            }
+            if (!bindValue(column, entry.second, newRow[column])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool createRow(const std::map<std::string, std::string>& data, uint64_t version) {
+        std::vector<Value> newRow;
+        if (!bindRow(data, newRow)) {
+            return false;
+        }
+        appendRow(newRow, version);
+        return true;
+    }
+
+    std::vector<Value> rowValues(size_t row) const {
+        std::vector<Value> values(columns.size());
+        for (size_t i = 0; i < columns.size(); ++i) {
+            values[i] = columns[i].valueAt(row);
+        }
+        return values;
+    }
+
+    void appendRow(const std::vector<Value>& values, uint64_t version) {
+        for (size_t i = 0; i < columns.size(); ++i) {
+            columns[i].append(values[i]);
+        }
+        for (auto& index : indexes) {
+            index.insert(values[index.column], rowCount);
+        }
+        for (auto& index : orderedIndexes) {
+            index->insert(values[index->column], rowCount);
+        }
+        if (rowCount % 64 == 0) {
+            tombstones.push_back(0);
+        }
+        beginVersions.push_back(version);
+        endVersions.push_back(liveVersion);
+        markDirty(rowCount);
+        ++rowCount;
+    }
+
+    bool isDeleted(size_t row) const {
+        return tombstones[row / 64] >> (row % 64) & 1;
+    }
+
+    bool isVisible(size_t row, uint64_t snapshot) const {
+        return beginVersions[row] <= snapshot && snapshot < endVersions[row];
+    }
+
+    void initVersions() {
+        beginVersions.assign(rowCount, 0);
+        endVersions.resize(rowCount);
+        for (size_t row = 0; row < rowCount; ++row) {
+            endVersions[row] = isDeleted(row) ? 0 : liveVersion;
+        }
+    }
+
+    size_t liveRows() const {
+        return rowCount - deletedCount;
+    }
+
+    const HashIndex* findIndex(size_t column) const {
+        for (const auto& index : indexes) {
+            if (index.column == column) {
+                return &index;
+            }
+        }
+        return nullptr;
+    }
+
+    const OrderedIndex* findOrderedIndex(size_t column) const {
+        for (const auto& index : orderedIndexes) {
+            if (index->column == column) {
+                return index.get();
+            }
+        }
+        return nullptr;
+    }
+
+    void buildIndex(HashIndex& index) const {
+        index.buckets.clear();
+        const Column& column = columns[index.column];
+        for (size_t row = 0; row < rowCount; ++row) {
+            index.insert(column.valueAt(row), row);
+        }
+    }
+
+    void buildIndex(OrderedIndex& index) const {
+        index.clear();
+        const Column& column = columns[index.column];
+        for (size_t row = 0; row < rowCount; ++row) {
+            index.insert(column.valueAt(row), row);
+        }
+    }
+
+    void createIndex(size_t column) {
+        indexes.push_back({column, {}});
+        buildIndex(indexes.back());
+    }
+
+    void createOrderedIndex(size_t column) {
+        std::unique_ptr<OrderedIndex> index;
+        switch (columns[column].type) {
+            case ColumnType::Int:
+                index.reset(new BTreeIndex<int64_t>(column));
+                break;
+            case ColumnType::Double:
+                index.reset(new BTreeIndex<double>(column));
+                break;
+            case ColumnType::String:
+                index.reset(new BTreeIndex<std::string>(column));
+                break;
+        }
+        buildIndex(*index);
+        orderedIndexes.push_back(std::move(index));
+    }
+
+    // Rows are updated in place, keeping their position, unless a scan holds
+    // a snapshot that may still read the old values. Then the old version is
+    // ended and the new one appended, and the row moves to the end.
+    void updateRow(size_t row, const std::vector<BoundAssignment>& assignments, uint64_t version) {
+        std::vector<Value> values = rowValues(row);
+        for (const auto& assignment : assignments) {
+            values[assignment.column] = assignment.value;
+        }
+        if (latch->scans.load() == 0) {
+            overwriteRow(row, values, version);
+            return;
+        }
+        deleteRow(row, version);
+        appendRow(values, version);
+    }
+
+    void overwriteRow(size_t row, const std::vector<Value>& values, uint64_t version) {
+        for (auto& index : indexes) {
+            Value old = columns[index.column].valueAt(row);
+            if (!(old == values[index.column])) {
+                index.erase(old, row);
+                index.insert(values[index.column], row);
+            }
+        }
+        for (auto& index : orderedIndexes) {
+            Value old = columns[index->column].valueAt(row);
+            if (!(old == values[index->column])) {
+                index->erase(old, row);
+                index->insert(values[index->column], row);
+            }
+        }
+        for (size_t i = 0; i < columns.size(); ++i) {
+            columns[i].set(row, values[i]);
+        }
+        beginVersions[row] = version;
+        markDirty(row);
+    }
+
+    bool loadRow(const char* begin, const char* end) {
+        const char* pos = begin;
+        bool valid = true;
+        for (auto& column : columns) {
+            size_t nameLength = column.name.size();
+            if (static_cast<size_t>(end - pos) < nameLength + 2 || column.name.compare(0, nameLength, pos, nameLength) != 0 || pos[nameLength] != ':' || pos[nameLength + 1] != ' ') {
+                valid = false;
+                break;
+            }
+            const char* valueBegin = pos + nameLength + 2;
+            const char* valueEnd = valueBegin;
+            while (valueEnd + 1 < end && !(valueEnd[0] == ',' && valueEnd[1] == ' ')) {
+                ++valueEnd;
+            }
+            if (valueEnd + 1 >= end || !column.appendText(valueBegin, valueEnd)) {
+                valid = false;
+                break;
+            }
+            pos = valueEnd + 2;
+        }
+
+        if (!valid || pos != end) {
+            for (auto& column : columns) {
+                column.resize(rowCount);
+            }
+            return false;
+        }
+        if (rowCount % 64 == 0) {
+            tombstones.push_back(0);
+        }
+        beginVersions.push_back(0);
+        endVersions.push_back(liveVersion);
+        markDirty(rowCount);
+        ++rowCount;
+        return true;
+    }
+
+    void deleteRow(size_t row, uint64_t version) {
+        tombstones[row / 64] |= uint64_t(1) << (row % 64);
+        endVersions[row] = version;
+        ++deletedCount;
+        markDirty(row);
+    }
+
+    void restoreRow(size_t row) {
+        tombstones[row / 64] &= ~(uint64_t(1) << (row % 64));
+        endVersions[row] = liveVersion;
+        --deletedCount;
+    }
+
+    void truncate(size_t rows) {
+        for (size_t row = rows; row < rowCount; ++row) {
+            for (auto& index : indexes) {
+                index.erase(columns[index.column].valueAt(row), row);
+            }
+            for (auto& index : orderedIndexes) {
+                index->erase(columns[index->column].valueAt(row), row);
+            }
+        }
+        for (auto& column : columns) {
+            column.resize(rows);
+        }
+        beginVersions.resize(rows);
+        endVersions.resize(rows);
+        tombstones.resize((rows + 63) / 64);
+        if (rows % 64 != 0) {
+            tombstones.back() &= (uint64_t(1) << (rows % 64)) - 1;
+        }
+        rowCount = rows;
+    }
+
+    bool needsCompaction() const {
+        return deletedCount >= 1024 && deletedCount * 2 >= rowCount;
+    }
+
+    size_t compact(uint64_t horizon) {
+        if (latch->scans.load() != 0) {
+            return 0;
+        }
+        std::vector<uint64_t> reclaimable(tombstones.size(), 0);
+        size_t reclaimed = 0;
+        for (size_t row = 0; row < rowCount; ++row) {
+            if (endVersions[row] <= horizon) {
+                reclaimable[row / 64] |= uint64_t(1) << (row % 64);
+                ++reclaimed;
+            }
+        }
+        if (reclaimed == 0) {
+            return 0;
+        }
+
+        for (auto& column : columns) {
+            column.compact(reclaimable, rowCount);
+        }
+        size_t out = 0;
+        for (size_t row = 0; row < rowCount; ++row) {
+            if (!(reclaimable[row / 64] >> (row % 64) & 1)) {
+                beginVersions[out] = beginVersions[row];
+                endVersions[out] = endVersions[row];
+                ++out;
+            }
+        }
+        rowCount = out;
+        beginVersions.resize(rowCount);
+        endVersions.resize(rowCount);
+        tombstones.assign((rowCount + 63) / 64, 0);
+        deletedCount = 0;
+        for (size_t row = 0; row < rowCount; ++row) {
+            if (endVersions[row] != liveVersion) {
+                tombstones[row / 64] |= uint64_t(1) << (row % 64);
+                ++deletedCount;
+            }
+        }
+        checkpointDirectory.clear();
+        for (auto& index : indexes) {
+            buildIndex(index);
+        }
+        for (auto& index : orderedIndexes) {
+            buildIndex(*index);
+        }
+        return reclaimed;
+    }
+
+    bool loadColumn(size_t column) {
+        if (!columns[column].materialize()) {
+            report("Error: Checksum mismatch in column {} of table {}\n", columns[column].name, name);
+            return false;
+        }
+        return true;
+    }
+
+    bool canCopyBlocks() const {
+        if (deletedCount != 0) {
+            return false;
+        }
+        for (const auto& column : columns) {
+            if (column.mapped.size() > 1) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Decodes the columns side by side on the scheduler; a column that fails
+    // is decoded again by loadColumn, which reports the error.
+    bool loadColumns(std::vector<size_t> wanted) {
+        std::sort(wanted.begin(), wanted.end());
+        wanted.erase(std::unique(wanted.begin(), wanted.end()), wanted.end());
+        if (taskScheduler != nullptr && wanted.size() > 1) {
+            taskScheduler->parallelFor(wanted.size(), [this, &wanted](size_t i) {
+                columns[wanted[i]].materialize();
+            });
+        }
+        for (size_t column : wanted) {
+            if (!loadColumn(column)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool loadAllColumns() {
+        std::vector<size_t> all(columns.size());
+        for (size_t column = 0; column < columns.size(); ++column) {
+            all[column] = column;
+        }
+        return loadColumns(all);
+    }
+
+    static void exprColumns(const Expr& expr, std::vector<size_t>& wanted) {
+        for (const auto& child : expr.children) {
+            exprColumns(*child, wanted);
+        }
+        if (expr.column != invalidColumn) {
+            wanted.push_back(expr.column);
+        }
+    }
+
+    bool exprColumnsLoaded(const Expr& expr) const {
+        for (const auto& child : expr.children) {
+            if (!exprColumnsLoaded(*child)) {
+                return false;
+            }
+        }
+        return expr.column == invalidColumn || columns[expr.column].isLoaded();
+    }
+
+    bool columnsLoaded(const BoundStatement& statement) const {
+        for (size_t column : statement.projection) {
+            if (!columns[column].isLoaded()) {
+                return false;
+            }
+        }
+        if (!statement.isAggregate() && statement.orderBy != invalidColumn && !columns[statement.orderBy].isLoaded()) {
+            return false;
+        }
+        return statement.where == nullptr || exprColumnsLoaded(*statement.where);
+    }
+
+    bool loadColumns(const BoundStatement& statement) {
+        std::vector<size_t> wanted = statement.projection;
+        for (const auto& assignment : statement.assignments) {
+            wanted.push_back(assignment.column);
+        }
+        if (statement.where != nullptr) {
+            exprColumns(*statement.where, wanted);
+        }
+        if (!statement.isAggregate() && statement.orderBy != invalidColumn) {
+            wanted.push_back(statement.orderBy);
+        }
+        return loadColumns(wanted);
+    }
+
+    // Recognizes count(*), count(col), sum(col), avg(col), min(col) and max(col).
+    static bool parseAggregate(const std::string& item, AggregateKind& kind, std::string& argument) {
+        static const std::pair<const char*, AggregateKind> functions[] = {
+            {"count", AggregateKind::Count},
+            {"sum", AggregateKind::Sum},
+            {"avg", AggregateKind::Avg},
+            {"min", AggregateKind::Min},
+            {"max", AggregateKind::Max},
+        };
+        size_t open = item.find('(');
+        if (open == std::string::npos || item.back() != ')') {
+            return false;
+        }
+        std::string function = item.substr(0, open);
+        for (auto& c : function) {
+            c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        }
+        for (const auto& entry : functions) {
+            if (function == entry.first) {
+                kind = entry.second;
+                argument = item.substr(open + 1, item.size() - open - 2);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool bindAggregates(const std::vector<std::string>& selectClause, const std::vector<std::string>& groupClause, BoundStatement& statement) const {
+        for (const auto& col : groupClause) {
+            size_t column = findColumn(col);
+            if (column == invalidColumn) {
+                report("Error: Column {} not found in table {}\n", col, name);
+                return false;
+            }
+            statement.groupBy.push_back(column);
+            statement.projection.push_back(column);
+        }
+
+        for (const auto& item : selectClause) {
+            AggregateKind kind;
+            std::string argument;
+            if (!parseAggregate(item, kind, argument)) {
+                auto grouped = std::find(groupClause.begin(), groupClause.end(), item);
+                if (grouped == groupClause.end()) {
+                    report("Error: Column {} must be grouped or aggregated\n", item);
+                    return false;
+                }
+                statement.output.push_back(static_cast<size_t>(grouped - groupClause.begin()));
+                continue;
+            }
+
+            size_t column = invalidColumn;
+            if (argument != "*" || kind != AggregateKind::Count) {
+                column = findColumn(argument);
+                if (column == invalidColumn) {
+                    report("Error: Column {} not found in table {}\n", argument, name);
+                    return false;
+                }
+                if ((kind == AggregateKind::Sum || kind == AggregateKind::Avg) && columns[column].type == ColumnType::String) {
+                    report("Error: Cannot compute {} of string column {}\n", item.substr(0, item.find('(')), argument);
+                    return false;
+                }
+                statement.projection.push_back(column);
+            }
+            statement.output.push_back(statement.groupBy.size() + statement.aggregates.size());
+            statement.aggregates.push_back({kind, column, item});
+        }
+
+        if (selectClause.empty()) {
+            for (size_t i = 0; i < statement.groupBy.size(); ++i) {
+                statement.output.push_back(i);
+            }
+        }
+        return true;
+    }
+
+    // Called after bindSelect. Aggregate queries are ordered by a column of
+    // their result, anything else by a table column.
+    bool bindOrder(const QueryStatement& query, BoundStatement& statement) const {
+        statement.descending = query.descending;
+        statement.limit = query.limit;
+        statement.offset = query.offset;
+        if (query.orderBy.empty()) {
+            return true;
+        }
+        if (!statement.isAggregate()) {
+            statement.orderBy = findColumn(query.orderBy);
+            if (statement.orderBy == invalidColumn) {
+                report("Error: Column {} not found in table {}\n", query.orderBy, name);
+                return false;
+            }
+            return true;
+        }
+        for (size_t i = 0; i < statement.output.size(); ++i) {
+            size_t item = statement.output[i];
+            size_t keys = statement.groupBy.size();
+            const std::string& label = item < keys ? columns[statement.groupBy[item]].name : statement.aggregates[item - keys].label;
+            if (label == query.orderBy) {
+                statement.orderBy = i;
+                return true;
+            }
+        }
+        report("Error: Cannot order by {}, it is not in the select list\n", query.orderBy);
+        return false;
+    }
+
+    bool bindSelect(const std::vector<std::string>& selectClause, const std::vector<std::string>& groupClause, BoundStatement& statement) const {
+        for (const auto& item : selectClause) {
+            AggregateKind kind;
+            std::string argument;
+            if (parseAggregate(item, kind, argument)) {
+                return bindAggregates(selectClause, groupClause, statement);
+            }
+        }
+        if (!groupClause.empty()) {
+            return bindAggregates(selectClause, groupClause, statement);
+        }
+
+        if (selectClause.empty()) {
+            for (size_t i = 0; i < columns.size(); ++i) {
+                statement.projection.push_back(i);
+            }
+            return true;
+        }
+        for (const auto& col : selectClause) {
+            size_t column = findColumn(col);
+            if (column == invalidColumn) {
+                report("Error: Column {} not found in table {}\n", col, name);
+                return false;
+            }
+            statement.projection.push_back(column);
+        }
+        return true;
+    }
+
+    bool bindExpr(const Expr& source, std::unique_ptr<Expr>& bound) const {
+        bound.reset(new Expr(source.kind));
+        bound->op = source.op;
+        for (const auto& child : source.children) {
+            bound->children.emplace_back();
+            if (!bindExpr(*child, bound->children.back())) {
+                return false;
+            }
+        }
+        if (source.kind == ExprKind::And || source.kind == ExprKind::Or || source.kind == ExprKind::Not) {
+            return true;
+        }
+
+        bound->column = findColumn(source.columnName);
+        if (bound->column == invalidColumn) {
+            report("Error: Column {} not found in table {}\n", source.columnName, name);
+            return false;
+        }
+        if (source.op == CompareOp::Prefix && columns[bound->column].type != ColumnType::String) {
+            report("Error: Prefix match needs a string column, {} is {}\n", source.columnName, columnTypeName(columns[bound->column].type));
+            return false;
+        }
+        bound->values.resize(source.literals.size());
+        for (size_t i = 0; i < source.literals.size(); ++i) {
+            if (!bindValue(bound->column, source.literals[i], bound->values[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool bindWhere(const Expr* whereClause, BoundStatement& statement) const {
+        if (whereClause == nullptr) {
+            return true;
+        }
+        if (!bindExpr(*whereClause, statement.where)) {
+            return false;
+        }
+        orderConjuncts(*statement.where);
+        return true;
+    }
+
+    // With statistics, the most selective conjuncts are evaluated first so
+    // the later ones see fewer rows.
+    void orderConjuncts(Expr& where) const {
+        if (columnStats.empty() || where.kind != ExprKind::And) {
+            return;
+        }
+        std::vector<std::pair<double, std::unique_ptr<Expr>>> ranked;
+        for (auto& child : where.children) {
+            double share = selectivity(*child);
+            ranked.emplace_back(share, std::move(child));
+        }
+        std::stable_sort(ranked.begin(), ranked.end(), [](const std::pair<double, std::unique_ptr<Expr>>& left, const std::pair<double, std::unique_ptr<Expr>>& right) {
+            return left.first < right.first;
+        });
+        for (size_t i = 0; i < ranked.size(); ++i) {
+            where.children[i] = std::move(ranked[i].second);
+        }
+    }
+
+    // Binds the conjunction of terms as the where clause.
+    bool bindWhere(const std::vector<const Expr*>& terms, BoundStatement& statement) const {
+        if (terms.size() <= 1) {
+            return bindWhere(terms.empty() ? nullptr : terms[0], statement);
+        }
+        statement.where.reset(new Expr(ExprKind::And));
+        for (const Expr* term : terms) {
+            statement.where->children.emplace_back();
+            if (!bindExpr(*term, statement.where->children.back())) {
+                return false;
+            }
+        }
+        orderConjuncts(*statement.where);
+        return true;
+    }
+
+    bool bindAssignments(const std::map<std::string, std::string>& updateData, BoundStatement& statement) const {
+        for (const auto& entry : updateData) {
+            size_t column = findColumn(entry.first);
+            if (column == invalidColumn) {
+                report("Error: Column {} not found in table {}\n", entry.first, name);
+                return false;
+            }
+            BoundAssignment assignment{column, Value()};
+            if (!bindValue(column, entry.second, assignment.value)) {
+                return false;
+            }
+            statement.assignments.push_back(assignment);
+        }
+        return true;
+    }
+
+    void filter(const Expr& expr, std::vector<size_t>& selection) const {
+        switch (expr.kind) {
+            case ExprKind::Compare:
+                columns[expr.column].filter(expr.op, expr.values[0], selection);
+                break;
+            case ExprKind::Between:
+                columns[expr.column].filter(CompareOp::GreaterEqual, expr.values[0], selection);
+                columns[expr.column].filter(CompareOp::LessEqual, expr.values[1], selection);
+                break;
+            case ExprKind::In:
+                columns[expr.column].filterIn(expr.values, selection);
+                break;
+            case ExprKind::And:
+                for (const auto& child : expr.children) {
+                    if (selection.empty()) {
+                        break;
+                    }
+                    filter(*child, selection);
+                }
+                break;
+            case ExprKind::Or: {
+                std::vector<size_t> remaining(selection);
+                std::vector<size_t> matched;
+                std::vector<size_t> childRows;
+                std::vector<size_t> merged;
+                for (const auto& child : expr.children) {
+                    if (remaining.empty()) {
+                        break;
+                    }
+                    childRows = remaining;
+                    filter(*child, childRows);
+                    merged.clear();
+                    std::merge(matched.begin(), matched.end(), childRows.begin(), childRows.end(), std::back_inserter(merged));
+                    matched.swap(merged);
+                    merged.clear();
+                    std::set_difference(remaining.begin(), remaining.end(), childRows.begin(), childRows.end(), std::back_inserter(merged));
+                    remaining.swap(merged);
+                }
+                selection.swap(matched);
+                break;
+            }
+            case ExprKind::Not: {
+                std::vector<size_t> excluded(selection);
+                filter(*expr.children[0], excluded);
+                std::vector<size_t> kept;
+                std::set_difference(selection.begin(), selection.end(), excluded.begin(), excluded.end(), std::back_inserter(kept));
+                selection.swap(kept);
+                break;
+            }
+        }
+    }
+
+    static void conjuncts(const Expr* where, std::vector<const Expr*>& terms) {
+        if (where == nullptr) {
+            return;
+        }
+        if (where->kind == ExprKind::And) {
+            for (const auto& child : where->children) {
+                terms.push_back(child.get());
+            }
+        } else {
+            terms.push_back(where);
+        }
+    }
+
+    // An index lookup costs about this many scanned rows per candidate row:
+    // candidates are fetched one at a time, sorted and filtered on a single
+    // thread, while a scan filters whole batches on every core.
+    static constexpr double indexRowCost = 20;
+
+    bool worthIndex(double candidates) const {
+        return candidates * indexRowCost < static_cast<double>(liveRows());
+    }
+
+    // The equality term whose hash index yields the fewest rows. Bucket sizes
+    // are exact, so this needs no statistics.
+    const Expr* chooseHashTerm(const std::vector<const Expr*>& terms, size_t& candidates) const {
+        const Expr* best = nullptr;
+        for (const Expr* term : terms) {
+            bool equality = term->kind == ExprKind::In || (term->kind == ExprKind::Compare && term->op == CompareOp::Equal);
+            const HashIndex* index = equality ? findIndex(term->column) : nullptr;
+            if (index == nullptr) {
+                continue;
+            }
+            size_t count = 0;
+            for (const auto& value : term->values) {
+                const std::vector<size_t>* bucket = index->find(value);
+                count += bucket != nullptr ? bucket->size() : 0;
+            }
+            if (best == nullptr || count < candidates) {
+                best = term;
+                candidates = count;
+            }
+        }
+        return best;
+    }
+
+    bool lookupIndex(const BoundStatement& statement, std::vector<size_t>& rows) const {
+        std::vector<const Expr*> terms;
+        conjuncts(statement.where.get(), terms);
+
+        size_t candidates = 0;
+        const Expr* term = chooseHashTerm(terms, candidates);
+        if (term == nullptr || !worthIndex(static_cast<double>(candidates))) {
+            return false;
+        }
+        const HashIndex* index = findIndex(term->column);
+        for (const auto& value : term->values) {
+            const std::vector<size_t>* bucket = index->find(value);
+            if (bucket != nullptr) {
+                rows.insert(rows.end(), bucket->begin(), bucket->end());
+            }
+        }
+        return true;
+    }
+
+    void tightenRange(KeyRange& range, ColumnType type, CompareOp op, const Value& value) const {
+        bool lower = op == CompareOp::Greater || op == CompareOp::GreaterEqual || op == CompareOp::Equal || op == CompareOp::Prefix;
+        bool upper = op == CompareOp::Less || op == CompareOp::LessEqual || op == CompareOp::Equal;
+        bool inclusive = op != CompareOp::Greater && op != CompareOp::Less;
+
+        if (lower) {
+            int order = range.hasLower ? compareValues(type, value, range.lower) : 1;
+            if (order > 0 || (order == 0 && !inclusive)) {
+                range.hasLower = true;
+                range.lower = value;
+                range.lowerInclusive = inclusive;
+            }
+        }
+        if (upper) {
+            int order = range.hasUpper ? compareValues(type, value, range.upper) : -1;
+            if (order < 0 || (order == 0 && !inclusive)) {
+                range.hasUpper = true;
+                range.upper = value;
+                range.upperInclusive = inclusive;
+            }
+        }
+        if (op == CompareOp::Prefix && (!range.hasPrefix || value.stringValue.size() > range.prefix.size())) {
+            range.hasPrefix = true;
+            range.prefix = value.stringValue;
+        }
+    }
+
+    static bool isRangeTerm(const Expr& term) {
+        for (const auto& value : term.values) {
+            if (value.isNull) {
+                return false;
+            }
+        }
+        return term.kind == ExprKind::Between || (term.kind == ExprKind::Compare && term.op != CompareOp::NotEqual);
+    }
+
+    // The range term whose ordered index reads the fewest rows by the
+    // histograms, if that beats a scan. Without statistics the first usable
+    // index is taken.
+    const Expr* chooseRangeTerm(const std::vector<const Expr*>& terms, KeyRange& range) const {
+        const Expr* best = nullptr;
+        double bestRows = 0;
+        for (const Expr* term : terms) {
+            if (!isRangeTerm(*term) || findOrderedIndex(term->column) == nullptr) {
+                continue;
+            }
+
+            KeyRange termRange;
+            ColumnType type = columns[term->column].type;
+            for (const Expr* other : terms) {
+                if (other->column != term->column || !isRangeTerm(*other)) {
+                    continue;
+                }
+                if (other->kind == ExprKind::Between) {
+                    tightenRange(termRange, type, CompareOp::GreaterEqual, other->values[0]);
+                    tightenRange(termRange, type, CompareOp::LessEqual, other->values[1]);
+                } else {
+                    tightenRange(termRange, type, other->op, other->values[0]);
+                }
+            }
+            if (term->column >= columnStats.size()) {
+                range = termRange;
+                return term;
+            }
+            double estimate = rangeShare(term->column, termRange) * static_cast<double>(liveRows());
+            if (best == nullptr || estimate < bestRows) {
+                best = term;
+                bestRows = estimate;
+                range = termRange;
+            }
+        }
+        return best != nullptr && worthIndex(bestRows) ? best : nullptr;
+    }
+
+    bool lookupOrderedIndex(const BoundStatement& statement, std::vector<size_t>& rows) const {
+        std::vector<const Expr*> terms;
+        conjuncts(statement.where.get(), terms);
+
+        KeyRange range;
+        const Expr* term = chooseRangeTerm(terms, range);
+        if (term == nullptr) {
+            return false;
+        }
+        findOrderedIndex(term->column)->collect(range, rows);
+        return true;
+    }
+
+    // Estimated share of rows with a non-null value in range.
+    double rangeShare(size_t column, const KeyRange& range) const {
+        const ColumnStats& stats = columnStats[column];
+        ColumnType type = columns[column].type;
+        double low = 0;
+        double high = 1;
+        if (range.hasLower) {
+            low = stats.shareBelow(type, range.lower, !range.lowerInclusive);
+        }
+        if (range.hasUpper) {
+            high = stats.shareBelow(type, range.upper, range.upperInclusive);
+        }
+        if (range.hasPrefix) {
+            Value prefix;
+            prefix.isNull = false;
+            prefix.stringValue = range.prefix;
+            low = std::max(low, stats.shareBelow(type, prefix, false));
+            prefix.stringValue += '\xff';
+            high = std::min(high, stats.shareBelow(type, prefix, false));
+        }
+        return stats.nonNull() * std::max(0.0, high - low);
+    }
+
+    // Estimated share of rows matching expr. Columns analyze has not seen
+    // count as one row in ten.
+    double selectivity(const Expr& expr) const {
+        switch (expr.kind) {
+            case ExprKind::And: {
+                double share = 1;
+                for (const auto& child : expr.children) {
+                    share *= selectivity(*child);
+                }
+                return share;
+            }
+            case ExprKind::Or: {
+                double share = 0;
+                for (const auto& child : expr.children) {
+                    double childShare = selectivity(*child);
+                    share = share + childShare - share * childShare;
+                }
+                return share;
+            }
+            case ExprKind::Not:
+                return 1 - selectivity(*expr.children[0]);
+            default:
+                break;
+        }
+        if (expr.column >= columnStats.size()) {
+            return 0.1;
+        }
+
+        const ColumnStats& stats = columnStats[expr.column];
+        ColumnType type = columns[expr.column].type;
+        double nonNull = stats.nonNull();
+        auto equalShare = [&stats, type, nonNull](const Value& value) {
+            if (value.isNull) {
+                return 1 - nonNull;
+            }
+            if (stats.min.isNull || compareValues(type, value, stats.min) < 0 || compareValues(type, value, stats.max) > 0) {
+                return 0.0;
+            }
+            return nonNull * stats.equalShare();
+        };
+        if (expr.kind == ExprKind::In) {
+            double share = 0;
+            for (const auto& value : expr.values) {
+                share += equalShare(value);
+            }
+            return std::min(1.0, share);
+        }
+        if (expr.kind == ExprKind::Between) {
+            return nonNull * std::max(0.0, stats.shareBelow(type, expr.values[1], true) - stats.shareBelow(type, expr.values[0], false));
+        }
+
+        const Value& value = expr.values[0];
+        if (value.isNull && expr.op != CompareOp::Equal && expr.op != CompareOp::NotEqual) {
+            return 0;
+        }
+        switch (expr.op) {
+            case CompareOp::Equal:
+                return equalShare(value);
+            case CompareOp::NotEqual:
+                return 1 - equalShare(value);
+            case CompareOp::Less:
+                return nonNull * stats.shareBelow(type, value, false);
+            case CompareOp::LessEqual:
+                return nonNull * stats.shareBelow(type, value, true);
+            case CompareOp::Greater:
+                return nonNull * (1 - stats.shareBelow(type, value, true));
+            case CompareOp::GreaterEqual:
+                return nonNull * (1 - stats.shareBelow(type, value, false));
+            case CompareOp::Prefix: {
+                KeyRange range;
+                range.hasPrefix = true;
+                range.prefix = value.stringValue;
+                return rangeShare(expr.column, range);
+            }
+        }
+        return 1;
+    }
+
+    void visibleRows(uint64_t snapshot, std::vector<size_t>& selection) const {
+        size_t out = 0;
+        for (size_t row : selection) {
+            selection[out] = row;
+            out += isVisible(row, snapshot);
+        }
+        selection.resize(out);
+    }
+
+    std::string formatHeader(const std::vector<size_t>& projection) const {
+        std::string header;
+        for (size_t column : projection) {
+            header += columns[column].name;
+            header += '\t';
+        }
+        header += '\n';
+        return header;
+    }
+
+    void formatRow(std::string& line, const std::vector<size_t>& projection, size_t row) const {
+        for (size_t column : projection) {
+            columns[column].appendTo(line, row);
+            line += '\t';
+        }
+        line += '\n';
+    }
+
+    // Walks the rows visible at statement.snapshot. When a lock is passed it
+    // is released between batches so writers can commit while a long scan
+    // runs; the snapshot keeps the result consistent. The walk stops after
+    // limit matches.
+    template <typename Callback>
+    void forEachMatch(const BoundStatement& statement, Callback callback, SharedLock* yield = nullptr, size_t limit = noLimit) const {
+        const size_t batchSize = 1024;
+        std::vector<size_t> selection;
+        selection.reserve(batchSize);
+        size_t matched = 0;
+
+        std::vector<size_t> candidates;
+        if (lookupIndex(statement, candidates) || lookupOrderedIndex(statement, candidates)) {
+            std::sort(candidates.begin(), candidates.end());
+            candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+            for (size_t start = 0; start < candidates.size(); start += batchSize) {
+                if (yield != nullptr && start != 0) {
+                    yield->unlock();
+                    yield->lock();
+                }
+                size_t end = std::min(candidates.size(), start + batchSize);
+                selection.assign(candidates.begin() + start, candidates.begin() + end);
+                visibleRows(statement.snapshot, selection);
+                if (statement.where != nullptr) {
+                    filter(*statement.where, selection);
+                }
+                for (size_t row : selection) {
+                    callback(row);
+                    if (++matched == limit) {
+                        return;
+                    }
+                }
+            }
+            return;
+        }
+
+        size_t rows = rowCount;
+        for (size_t start = 0; start < rows; start += batchSize) {
+            if (yield != nullptr && start != 0) {
+                yield->unlock();
+                yield->lock();
+            }
+            matchBatch(statement, start, std::min(rows, start + batchSize), selection);
+            for (size_t row : selection) {
+                callback(row);
+                if (++matched == limit) {
+                    return;
+                }
+            }
+        }
+    }
+
+    // Whether filterBits can evaluate expr: numeric comparisons against a
+    // literal, combined with and, or and not.
+    bool hasKernel(const Expr& expr) const {
+        switch (expr.kind) {
+            case ExprKind::Compare:
+                return columns[expr.column].hasKernel(expr.op, expr.values[0]);
+            case ExprKind::Between:
+                return columns[expr.column].hasKernel(CompareOp::GreaterEqual, expr.values[0]) &&
+                       columns[expr.column].hasKernel(CompareOp::LessEqual, expr.values[1]);
+            case ExprKind::And:
+            case ExprKind::Or:
+            case ExprKind::Not:
+                for (const auto& child : expr.children) {
+                    if (!hasKernel(*child)) {
+                        return false;
+                    }
+                }
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // The bitmap form of filter over the consecutive rows [start, start + count).
+    void filterBits(const Expr& expr, size_t start, size_t count, uint64_t* bits) const {
+        size_t words = (count + 63) / 64;
+        uint64_t other[kernelRows / 64];
+        switch (expr.kind) {
+            case ExprKind::Compare:
+                columns[expr.column].compareBits(expr.op, expr.values[0], start, count, bits);
+                break;
+            case ExprKind::Between:
+                columns[expr.column].compareBits(CompareOp::GreaterEqual, expr.values[0], start, count, bits);
+                columns[expr.column].compareBits(CompareOp::LessEqual, expr.values[1], start, count, other);
+                for (size_t word = 0; word < words; ++word) {
+                    bits[word] &= other[word];
+                }
+                break;
+            case ExprKind::And:
+            case ExprKind::Or:
+                filterBits(*expr.children[0], start, count, bits);
+                for (size_t child = 1; child < expr.children.size(); ++child) {
+                    filterBits(*expr.children[child], start, count, other);
+                    for (size_t word = 0; word < words; ++word) {
+                        bits[word] = expr.kind == ExprKind::And ? bits[word] & other[word] : bits[word] | other[word];
+                    }
+                }
+                break;
+            case ExprKind::Not:
+                filterBits(*expr.children[0], start, count, bits);
+                for (size_t word = 0; word < words; ++word) {
+                    bits[word] = ~bits[word];
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Terms with kernels are evaluated into a bitmap for the whole batch, and
+    // only the rows that pass them are checked for visibility. Any other
+    // conjuncts then filter the resulting selection.
+    void matchBatch(const BoundStatement& statement, size_t start, size_t end, std::vector<size_t>& selection) const {
+        const Expr* where = statement.where.get();
+        size_t count = end - start;
+        uint64_t bits[kernelRows / 64];
+        bool masked = false;
+        bool whole = where != nullptr && count <= kernelRows && hasKernel(*where);
+        if (whole) {
+            filterBits(*where, start, count, bits);
+            masked = true;
+        } else if (where != nullptr && count <= kernelRows && where->kind == ExprKind::And) {
+            uint64_t other[kernelRows / 64];
+            for (const auto& child : where->children) {
+                if (!hasKernel(*child)) {
+                    continue;
+                }
+                filterBits(*child, start, count, masked ? other : bits);
+                if (masked) {
+                    for (size_t word = 0; word < (count + 63) / 64; ++word) {
+                        bits[word] &= other[word];
+                    }
+                }
+                masked = true;
+            }
+        }
+
+        selection.resize(count);
+        size_t out = 0;
+        if (masked) {
+            size_t words = (count + 63) / 64;
+            if (count % 64 != 0) {
+                bits[words - 1] &= (uint64_t(1) << (count % 64)) - 1;
+            }
+            for (size_t word = 0; word < words; ++word) {
+                for (uint64_t set = bits[word]; set != 0; set &= set - 1) {
+                    size_t row = start + word * 64 + __builtin_ctzll(set);
+                    selection[out] = row;
+                    out += isVisible(row, statement.snapshot);
+                }
+            }
+        } else {
+            for (size_t row = start; row < end; ++row) {
+                selection[out] = row;
+                out += isVisible(row, statement.snapshot);
+            }
+        }
+        selection.resize(out);
+
+        if (where == nullptr || whole) {
+            return;
+        }
+        if (!masked) {
+            filter(*where, selection);
+            return;
+        }
+        for (const auto& child : where->children) {
+            if (selection.empty()) {
+                break;
+            }
+            if (!hasKernel(*child)) {
+                filter(*child, selection);
+            }
+        }
+    }
+
+    bool hasUsableIndex(const BoundStatement& statement) const {
+        std::vector<const Expr*> terms;
+        conjuncts(statement.where.get(), terms);
+        size_t candidates = 0;
+        KeyRange range;
+        return (chooseHashTerm(terms, candidates) != nullptr && worthIndex(static_cast<double>(candidates))) ||
+               chooseRangeTerm(terms, range) != nullptr;
+    }
+};
+
+// Owns one shard of a sharded table. Tasks run one at a time on the worker's
+// own thread, pinned to a core when one is given, so the shard itself needs
+// no latch.
+class ShardWorker {
+public:
+    ShardWorker(Table shardTable, int core) : shard(std::move(shardTable)), thread(&ShardWorker::run, this) {
+        if (core >= 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(core, &cpus);
+            pinned = pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus) == 0;
+        }
+    }
+
+    ShardWorker(const ShardWorker&) = delete;
+    ShardWorker& operator=(const ShardWorker&) = delete;
+
+    ~ShardWorker() {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            stopping = true;
+        }
+        wakeup.notify_one();
+        thread.join();
+    }
+
+    std::future<void> post(std::function<void(Table&)> task) {
+        std::packaged_task<void()> job([this, task] {
+            task(shard);
+        });
+        std::future<void> done = job.get_future();
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            mailbox.push_back(std::move(job));
+        }
+        wakeup.notify_one();
+        return done;
+    }
+
+    bool isPinned() const {
+        return pinned;
+    }
+
+    // Only safe while no task can be posted, i.e. under the exclusive catalog lock.
+    Table& table() {
+        return shard;
+    }
+
+private:
+    Table shard;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::deque<std::packaged_task<void()>> mailbox;
+    bool stopping = false;
+    bool pinned = false;
+    std::thread thread;
+
+    void run() {
+        quietOutput = true;
+        while (true) {
+            std::packaged_task<void()> job;
+            {
+                std::unique_lock<std::mutex> guard(mutex);
+                wakeup.wait(guard, [this] {
+                    return stopping || !mailbox.empty();
+                });
+                if (mailbox.empty()) {
+                    return;
+                }
+                job = std::move(mailbox.front());
+                mailbox.pop_front();
+            }
+            job();
+        }
+    }
+};
+
+// A row a transaction changed, with its values and begin version before the
+// change, so that a failed transaction can put it back.
+struct ChangedRow {
+    Table* table;
+    size_t row;
+    std::vector<Value> values;
+    uint64_t version;
+};
+
+// A sharded table keeps its schema and index definitions in the catalog and
+// its rows in the shards, partitioned by the hash of the key column.
+struct ShardSet {
+    size_t keyColumn;
+    std::vector<std::unique_ptr<ShardWorker>> workers;
+    SharedLatch writeLatch;
+};
+
+class SimpleDatabase {
+private:
+    std::map<std::string, Table> tables;
+    std::map<std::string, std::unique_ptr<ShardSet>> shardedTables;
+    SharedLatch catalogLock;
+    WriteAheadLog* wal = nullptr;
+
+    std::unique_ptr<Scheduler> scheduler;
+
+    std::mutex commitLock;
+    std::atomic<uint64_t> committedVersion{0};
+    std::mutex snapshotLock;
+    std::multiset<uint64_t> activeSnapshots;
+
+    uint64_t beginSnapshot(Table& table) {
+        std::lock_guard<std::mutex> guard(snapshotLock);
+        uint64_t snapshot = committedVersion.load();
+        activeSnapshots.insert(snapshot);
+        ++table.latch->scans;
+        return snapshot;
+    }
+
+    void endSnapshot(Table& table, uint64_t snapshot) {
+        std::lock_guard<std::mutex> guard(snapshotLock);
+        activeSnapshots.erase(activeSnapshots.find(snapshot));
+        --table.latch->scans;
+    }
+
+    template <typename Apply>
+    bool installVersion(Apply apply) {
+        std::lock_guard<std::mutex> guard(commitLock);
+        uint64_t version = committedVersion.load() + 1;
+        if (!apply(version)) {
+            return false;
+        }
+        committedVersion.store(version);
+        return true;
+    }
+
+    // Writers hold the table's writer lock, so every version of the table is
+    // committed and the scan can run under a shared lock next to readers.
+    std::vector<size_t> findRows(Table& table, BoundStatement& statement) {
+        SharedLock tableLock(table.latch->lock);
+        statement.snapshot = beginSnapshot(table);
+        std::vector<size_t> rows;
+        std::vector<std::vector<size_t>> found(scanSlots());
+        parallelScan(table, statement, &tableLock, [&found](size_t slot, size_t row) {
+            found[slot].push_back(row);
+        }, [&found, &rows](size_t slot) {
+            rows.insert(rows.end(), found[slot].begin(), found[slot].end());
+            found[slot].clear();
+        });
+        endSnapshot(table, statement.snapshot);
+        return rows;
+    }
+
+    static const size_t morselRows = 16384;
+
+    size_t scanSlots() const {
+        return scheduler->size() * 2;
+    }
+
+    // Full scans run as morsels of morselRows rows on the scheduler, one wave
+    // of scanSlots() morsels at a time. visit(slot, row) gets each morsel's
+    // matches in row order on a pool thread; flush(slot) then runs on the
+    // calling thread in morsel order, and the yield lock, if any, is released
+    // between waves so writers can commit. Index lookups and small tables use one slot,
+    // flushed every 1024 matches. Once limit rows have matched in morsel
+    // order no further morsels are started, and no slot visits more than limit.
+    template <typename Visit, typename Flush>
+    void parallelScan(const Table& table, const BoundStatement& statement, SharedLock* yield, Visit visit, Flush flush, size_t limit = noLimit) {
+        size_t rows = table.rowCount;
+        if (rows <= morselRows || table.hasUsableIndex(statement)) {
+            size_t matched = 0;
+            table.forEachMatch(statement, [&visit, &flush, &matched](size_t row) {
+                visit(0, row);
+                if (++matched % 1024 == 0) {
+                    flush(0);
+                }
+            }, yield, limit);
+            flush(0);
+            return;
+        }
+
+        size_t morsels = (rows + morselRows - 1) / morselRows;
+        size_t slots = scanSlots();
+        std::vector<size_t> matched(slots);
+        size_t total = 0;
+        for (size_t wave = 0; wave < morsels && total < limit; wave += slots) {
+            if (wave != 0 && yield != nullptr) {
+                yield->unlock();
+                yield->lock();
+            }
+            size_t count = std::min(slots, morsels - wave);
+            scheduler->parallelFor(count, [&table, &statement, &visit, &matched, wave, rows, limit](size_t slot) {
+                const size_t batchSize = 1024;
+                size_t start = (wave + slot) * morselRows;
+                size_t end = std::min(rows, start + morselRows);
+                std::vector<size_t> selection;
+                selection.reserve(batchSize);
+                matched[slot] = 0;
+                for (size_t batch = start; batch < end && matched[slot] < limit; batch += batchSize) {
+                    table.matchBatch(statement, batch, std::min(end, batch + batchSize), selection);
+                    for (size_t row : selection) {
+                        visit(slot, row);
+                        if (++matched[slot] == limit) {
+                            break;
+                        }
+                    }
+                }
+            });
+            for (size_t slot = 0; slot < count; ++slot) {
+                flush(slot);
+                total += matched[slot];
+            }
+        }
+    }
+
+    bool applyWrite(Table& table, const WriteStatement& statement, uint64_t version, std::vector<ChangedRow>& changed) {
+        if (statement.type == LogRecordType::Insert) {
+            return table.createRow(statement.values, version);
+        }
+
+        bool update = statement.type == LogRecordType::Update;
+        BoundStatement bound;
+        if (!table.bindWhere(statement.where.get(), bound) || (update && !table.bindAssignments(statement.values, bound))) {
+            return false;
+        }
+        bound.snapshot = version;
+        std::vector<size_t> rows;
+        table.forEachMatch(bound, [&rows](size_t row) {
+            rows.push_back(row);
+        });
+        for (size_t row : rows) {
+            changed.push_back({&table, row, update ? table.rowValues(row) : std::vector<Value>(), table.beginVersions[row]});
+            if (update) {
+                table.updateRow(row, bound.assignments, version);
+            } else {
+                table.deleteRow(row, version);
+            }
+        }
+        return true;
+    }
+
+    void compactIfNeeded(Table& table) {
+        if (table.needsCompaction() && table.loadAllColumns()) {
+            table.compact(oldestSnapshot());
+        }
+    }
+
+    uint64_t oldestSnapshot() {
+        std::lock_guard<std::mutex> guard(snapshotLock);
+        return activeSnapshots.empty() ? committedVersion.load() : *activeSnapshots.begin();
+    }
+
+    ShardSet* findShards(const std::string& tableName) {
+        auto it = shardedTables.find(tableName);
+        return it != shardedTables.end() ? it->second.get() : nullptr;
+    }
+
+    static size_t shardOf(const Value& key, size_t shards) {
+        return mixHash(ValueHash()(key)) % shards;
+    }
+
+    // Runs task on the shard owning key, or on every shard at once. Shards
+    // keep no versions: each worker applies its tasks one at a time, so a
+    // write is visible to the next task and is stamped with version 0.
+    template <typename Task>
+    void onShards(ShardSet& shards, const Value* key, Task task) {
+        std::vector<std::future<void>> pending;
+        for (size_t i = 0; i < shards.workers.size(); ++i) {
+            if (key == nullptr || shardOf(*key, shards.workers.size()) == i) {
+                pending.push_back(shards.workers[i]->post([&task, i](Table& shard) {
+                    task(shard, i);
+                }));
+            }
+        }
+        for (auto& done : pending) {
+            done.get();
+        }
+    }
+
+    // An equality on the key column routes the statement to a single shard.
+    static const Value* shardKey(const ShardSet& shards, const BoundStatement& statement) {
+        std::vector<const Expr*> terms;
+        Table::conjuncts(statement.where.get(), terms);
+        for (const Expr* term : terms) {
+            if (term->kind == ExprKind::Compare && term->op == CompareOp::Equal && term->column == shards.keyColumn) {
+                return &term->values[0];
+            }
+        }
+        return nullptr;
+    }
+
+    // Single-shard writes append their record on the shard's worker, so the
+    // log keeps each shard's order while other shards write alongside;
+    // writes that span every shard exclude them instead.
+    template <typename Apply>
+    bool writeShards(ShardSet& shards, const Value* key, const std::string& record, Apply apply) {
+        if (key != nullptr) {
+            // The shard's worker logs the record before applying it, so
+            // records reach the log in the order the shard applies them.
+            bool logged = true;
+            SharedLock writes(shards.writeLatch);
+            onShards(shards, key, [this, &record, &logged, &apply](Table& shard, size_t) {
+                logged = wal == nullptr || wal->commit(wal->append(record));
+                if (logged) {
+                    apply(shard);
+                }
+            });
+            if (!logged) {
+                report("Error: Unable to write to the write-ahead log\n");
+            }
+            return logged;
+        }
+
+        ExclusiveLock writes(shards.writeLatch);
+        if (!logStatement(record)) {
+            return false;
+        }
+        onShards(shards, nullptr, [&apply](Table& shard, size_t) {
+            apply(shard);
+        });
+        return true;
+    }
+
+    static void collectRows(Table& shard, const BoundStatement& statement, std::vector<size_t>& rows) {
+        shard.forEachMatch(statement, [&rows](size_t row) {
+            rows.push_back(row);
+        });
+    }
+
+    static void gatherShards(Table& table, ShardSet& shards) {
+        for (auto& worker : shards.workers) {
+            Table& shard = worker->table();
+            shard.forEachMatch(BoundStatement(), [&table, &shard](size_t row) {
+                table.appendRow(shard.rowValues(row), 0);
+            });
+        }
+    }
+
+    size_t liveRows(const std::string& tableName, const Table& table) {
+        ShardSet* shards = findShards(tableName);
+        if (shards == nullptr) {
+            return table.liveRows();
+        }
+        size_t rows = 0;
+        for (auto& worker : shards->workers) {
+            rows += worker->table().liveRows();
+        }
+        return rows;
+    }
+
+    std::mutex checkpointLock;
+    CheckpointProgress* checkpointProgress = nullptr;
+    pid_t checkpointPid = -1;
+    std::string checkpointFile;
+    CheckpointKind checkpointKind = CheckpointKind::Text;
+    std::chrono::steady_clock::time_point checkpointStart;
+    std::string lastCheckpoint;
+    uint64_t checkpointGeneration = 0;
+    std::vector<ChunkWrite> pendingChunks;
+    size_t checkpointChunks = 0;
+    // Log position and index and shard records of the state being saved,
+    // which restart the log once the save is done.
+    uint64_t checkpointLsn = 0;
+    std::vector<std::string> checkpointState;
+    uint64_t baseGeneration = 0;
+
+    void reportProgress(uint64_t written) {
+        if (checkpointProgress != nullptr) {
+            uint64_t previous = checkpointProgress->written.load(std::memory_order_relaxed);
+            while (previous < written && !checkpointProgress->written.compare_exchange_weak(previous, written, std::memory_order_relaxed)) {
+            }
+        }
+    }
+
+    uint64_t planCheckpoint(const std::string& directory) {
+        uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        checkpointGeneration = std::max(checkpointGeneration + 1, now);
+        pendingChunks.clear();
+        checkpointChunks = 0;
+
+        uint64_t total = 0;
+        for (auto& entry : tables) {
+            Table& table = entry.second;
+            bool sharded = findShards(entry.first) != nullptr;
+            size_t rows = sharded ? liveRows(entry.first, table) : table.rowCount;
+            size_t chunkCount = (rows + checkpointChunkRows - 1) / checkpointChunkRows;
+            bool full = sharded || table.checkpointDirectory != directory;
+            table.dirtyChunks.resize(chunkCount, 1);
+            table.chunkFiles.resize(chunkCount);
+            for (size_t chunk = 0; chunk < chunkCount; ++chunk) {
+                if (full || table.dirtyChunks[chunk]) {
+                    table.chunkFiles[chunk] = fmt::format("{:016x}-{}.chunk", checkpointGeneration, pendingChunks.size());
+                    pendingChunks.push_back({entry.first, chunk});
+                    total += std::min(checkpointChunkRows, rows - chunk * checkpointChunkRows) * table.columns.size();
+                }
+            }
+            table.dirtyChunks.assign(chunkCount, 0);
+            table.checkpointDirectory = directory;
+            checkpointChunks += chunkCount;
+        }
+        return total;
+    }
+
+    void forgetCheckpoint() {
+        ExclusiveLock catalog(catalogLock);
+        for (auto& entry : tables) {
+            entry.second.checkpointDirectory.clear();
+        }
+    }
+
+    void startCheckpoint(const std::string& filename, CheckpointKind kind) {
+        std::lock_guard<std::mutex> guard(checkpointLock);
+        pollCheckpoint(true);
+        if (checkpointProgress == nullptr) {
+            void* shared = mmap(nullptr, sizeof(CheckpointProgress), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (shared == MAP_FAILED) {
+                report("Error: Unable to start background save\n");
+                return;
+            }
+            checkpointProgress = new (shared) CheckpointProgress();
+        }
+
+        ExclusiveLock catalog(catalogLock);
+        uint64_t total = 0;
+        if (kind == CheckpointKind::Incremental) {
+            if (mkdir(filename.c_str(), 0755) != 0 && errno != EEXIST) {
+                report("Error: Unable to create directory {}\n", filename);
+                return;
+            }
+            total = planCheckpoint(filename);
+        } else {
+            for (const auto& entry : tables) {
+                total += liveRows(entry.first, entry.second) * entry.second.columns.size();
+            }
+        }
+        checkpointProgress->written.store(0);
+        checkpointProgress->total.store(total);
+        checkpointProgress->elapsed.store(0);
+        checkpointStart = std::chrono::steady_clock::now();
+        if (wal != nullptr) {
+            captureLogState();
+        }
+
+        std::cout.flush();
+        std::fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            if (kind == CheckpointKind::Incremental) {
+                catalog.unlock();
+                forgetCheckpoint();
+            }
+            report("Error: Unable to start background save\n");
+            return;
+        }
+        // The child is a copy of a multithreaded process with only this thread
+        // running, so it must not start threads or wait on the scheduler,
+        // whose workers and locks were left behind. It writes the snapshot
+        // on this thread alone and leaves through _exit.
+        if (pid == 0) {
+            quietOutput = true;
+            taskScheduler = nullptr;
+            for (auto& entry : shardedTables) {
+                gatherShards(tables[entry.first], *entry.second);
+            }
+            bool saved = false;
+            switch (kind) {
+                case CheckpointKind::Text:
+                    saved = saveToFile(filename);
+                    break;
+                case CheckpointKind::Snapshot:
+                    saved = saveSnapshot(filename);
+                    break;
+                case CheckpointKind::Incremental:
+                    saved = saveCheckpoint(filename);
+                    break;
+            }
+            checkpointProgress->elapsed.store(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - checkpointStart).count());
+            _exit(saved ? 0 : 1);
+        }
+
+        checkpointPid = pid;
+        checkpointFile = filename;
+        checkpointKind = kind;
+        report("Background save to {} started\n", filename);
+    }
+
+    void pollCheckpoint(bool wait) {
+        if (checkpointPid <= 0) {
+            return;
+        }
+        int status = 0;
+        pid_t result = waitpid(checkpointPid, &status, wait ? 0 : WNOHANG);
+        if (result == 0) {
+            return;
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - checkpointStart).count();
+        if (checkpointProgress->elapsed.load() != 0) {
+            seconds = checkpointProgress->elapsed.load() / 1e9;
+        }
+        if (result == checkpointPid && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            switch (checkpointKind) {
+                case CheckpointKind::Text:
+                    lastCheckpoint = fmt::format("Database saved to {} in {:.3f}s", checkpointFile, seconds);
+                    break;
+                case CheckpointKind::Snapshot:
+                    lastCheckpoint = fmt::format("Snapshot saved to {} in {:.3f}s", checkpointFile, seconds);
+                    break;
+                case CheckpointKind::Incremental:
+                    lastCheckpoint = fmt::format("Checkpoint saved to {} in {:.3f}s, {} of {} chunks written", checkpointFile, seconds, pendingChunks.size(), checkpointChunks);
+                    break;
+            }
+            if (wal != nullptr) {
+                rebaseLog();
+            }
+        } else {
+            if (checkpointKind == CheckpointKind::Incremental) {
+                forgetCheckpoint();
+            }
+            lastCheckpoint = fmt::format("Error: Background save to {} failed after {:.3f}s", checkpointFile, seconds);
+        }
+        checkpointPid = -1;
+        report("{}\n", lastCheckpoint);
+    }
+
+    // Called under the exclusive catalog lock, when no write is between
+    // being logged and being applied.
+    void captureLogState() {
+        checkpointLsn = wal->position();
+        checkpointState.clear();
+        for (const auto& entry : tables) {
+            const Table& table = entry.second;
+            for (const auto& index : table.indexes) {
+                checkpointState.push_back(logRecord(LogRecordType::CreateIndex, entry.first));
+                appendBinary(checkpointState.back(), table.columns[index.column].name);
+                appendBinary<uint8_t>(checkpointState.back(), 0);
+            }
+            for (const auto& index : table.orderedIndexes) {
+                checkpointState.push_back(logRecord(LogRecordType::CreateIndex, entry.first));
+                appendBinary(checkpointState.back(), table.columns[index->column].name);
+                appendBinary<uint8_t>(checkpointState.back(), 1);
+            }
+        }
+        for (const auto& entry : shardedTables) {
+            checkpointState.push_back(logRecord(LogRecordType::Shard, entry.first));
+            appendBinary(checkpointState.back(), tables[entry.first].columns[entry.second->keyColumn].name);
+            appendBinary<uint32_t>(checkpointState.back(), static_cast<uint32_t>(entry.second->workers.size()));
+        }
+    }
+
+    // Links or copies a loaded or saved file next to the log, where nothing
+    // else writes to it, so that replaying the log reads what was loaded.
+    std::string keepFile(const std::string& source) {
+        uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        baseGeneration = std::max(baseGeneration + 1, now);
+        std::string base = fmt::format("{}.{:016x}.base", wal->filePath(), baseGeneration);
+
+        struct stat info;
+        bool kept = stat(source.c_str(), &info) == 0;
+        if (kept && S_ISDIR(info.st_mode)) {
+            DIR* listing = mkdir(base.c_str(), 0755) == 0 ? opendir(source.c_str()) : nullptr;
+            kept = listing != nullptr;
+            while (kept) {
+                dirent* item = readdir(listing);
+                if (item == nullptr) {
+                    break;
+                }
+                std::string fileName = item->d_name;
+                if (fileName != "." && fileName != ".." && (fileName.size() < 4 || fileName.compare(fileName.size() - 4, 4, ".tmp") != 0)) {
+                    kept = linkOrCopy(source + "/" + fileName, base + "/" + fileName);
+                }
+            }
+            if (listing != nullptr) {
+                closedir(listing);
+            }
+            kept = kept && syncDirectory(base);
+        } else if (kept) {
+            kept = linkOrCopy(source, base);
+        }
+        if (!kept || !syncDirectory(parentDirectory(base))) {
+            removePath(base);
+            report("Error: Unable to keep a copy of {} for the write-ahead log\n", source);
+            return std::string();
+        }
+        return base;
+    }
+
+    // Deletes the kept files of this log that none of its records load.
+    void removeUnusedBases(const std::string& log) {
+        std::set<std::string> used;
+        WriteAheadLog::frames(log, [&used](const char* payload, size_t length, size_t) {
+            ByteReader reader(payload, payload + length);
+            if (reader.read<uint8_t>() == static_cast<uint8_t>(LogRecordType::Load)) {
+                used.insert(reader.readString());
+            }
+            return true;
+        });
+
+        std::string directory = parentDirectory(wal->filePath());
+        std::string prefix = wal->filePath() + ".";
+        DIR* listing = opendir(directory.empty() ? "." : directory.c_str());
+        if (listing == nullptr) {
+            return;
+        }
+        while (dirent* item = readdir(listing)) {
+            std::string fileName = item->d_name;
+            std::string path = directory.empty() ? fileName : directory == "/" ? "/" + fileName : directory + "/" + fileName;
+            if (path.size() > prefix.size() + 5 && path.compare(0, prefix.size(), prefix) == 0 && path.compare(path.size() - 5, 5, ".base") == 0 && used.count(path) == 0) {
+                removePath(path);
+            }
+        }
+        closedir(listing);
+    }
+
+    // Restarts the log from a copy of the finished save: one load of the copy,
+    // the indexes and shards it does not record, then the records logged
+    // since the save began.
+    void rebaseLog() {
+        std::string base = keepFile(checkpointFile);
+        if (base.empty()) {
+            return;
+        }
+        std::vector<std::string> head{logRecord(LogRecordType::Load, base)};
+        head.insert(head.end(), checkpointState.begin(), checkpointState.end());
+        std::string log;
+        if (!wal->rewrite(head, checkpointLsn, log)) {
+            removePath(base);
+            report("Error: Unable to truncate the write-ahead log\n");
+            return;
+        }
+        removeUnusedBases(log);
+    }
+
+    static std::string logRecord(LogRecordType type, const std::string& name) {
+        std::string record;
+        appendBinary<uint8_t>(record, static_cast<uint8_t>(type));
+        appendBinary(record, name);
+        return record;
+    }
+
+    static std::string writeRecord(LogRecordType type, const std::string& tableName, const std::map<std::string, std::string>& values, const Expr* where) {
+        std::string record = logRecord(type, tableName);
+        if (type != LogRecordType::Delete) {
+            appendBinary<uint32_t>(record, static_cast<uint32_t>(values.size()));
+            for (const auto& entry : values) {
+                appendBinary(record, entry.first);
+                appendBinary(record, entry.second);
+            }
+        }
+        if (type != LogRecordType::Insert) {
+            appendExpr(record, where);
+        }
+        return record;
+    }
+
+    static std::string writeRecord(const WriteStatement& statement) {
+        return writeRecord(statement.type, statement.table, statement.values, statement.where.get());
+    }
+
+    static bool readWrite(ByteReader& reader, LogRecordType type, WriteStatement& statement) {
+        statement.type = type;
+        if (type != LogRecordType::Delete) {
+            uint32_t count = reader.read<uint32_t>();
+            for (uint32_t i = 0; i < count && reader.ok; ++i) {
+                std::string columnName = reader.readString();
+                statement.values[columnName] = reader.readString();
+            }
+        }
+        return reader.ok && (type == LogRecordType::Insert || readExpr(reader, statement.where));
+    }
+
+    bool logStatement(const std::string& record) {
+        if (wal == nullptr) {
+            return true;
+        }
+        if (!wal->commit(wal->append(record))) {
+            report("Error: Unable to write to the write-ahead log\n");
+            return false;
+        }
+        return true;
+    }
+
+    bool applyLogRecord(const char* data, size_t length) {
+        ByteReader reader(data, data + length);
+        uint8_t type = reader.read<uint8_t>();
+        std::string name = reader.readString();
+
+        switch (static_cast<LogRecordType>(type)) {
+            case LogRecordType::CreateTable: {
+                std::vector<Column> columns(reader.read<uint32_t>());
+                for (auto& column : columns) {
+                    column.name = reader.readString();
+                    column.type = static_cast<ColumnType>(reader.read<uint8_t>());
+                }
+                if (reader.ok) {
+                    createTable(name, columns);
+                }
+                break;
+            }
+            case LogRecordType::AddColumn: {
+                Column column;
+                column.name = reader.readString();
+                column.type = static_cast<ColumnType>(reader.read<uint8_t>());
+                if (reader.ok) {
+                    addColumnToTable(name, column);
+                }
+                break;
+            }
+            case LogRecordType::CreateIndex: {
+                std::string columnName = reader.readString();
+                bool ordered = reader.read<uint8_t>() != 0;
+                if (reader.ok) {
+                    createIndex(name, columnName, ordered);
+                }
+                break;
+            }
+            case LogRecordType::Insert:
+            case LogRecordType::Update:
+            case LogRecordType::Delete: {
+                WriteStatement statement;
+                statement.table = name;
+                if (!readWrite(reader, static_cast<LogRecordType>(type), statement)) {
+                    break;
+                }
+                if (statement.type == LogRecordType::Insert) {
+                    insertData(name, statement.values);
+                } else if (statement.type == LogRecordType::Update) {
+                    updateData(name, statement.values, statement.where.get());
+                } else {
+                    deleteData(name, statement.where.get());
+                }
+                break;
+            }
+            case LogRecordType::Batch: {
+                std::vector<WriteStatement> statements(reader.read<uint32_t>());
+                for (auto& statement : statements) {
+                    if (!reader.ok) {
+                        break;
+                    }
+                    uint8_t statementType = reader.read<uint8_t>();
+                    statement.table = reader.readString();
+                    if (statementType < static_cast<uint8_t>(LogRecordType::Insert) || statementType > static_cast<uint8_t>(LogRecordType::Delete)) {
+                        reader.ok = false;
+                    } else {
+                        readWrite(reader, static_cast<LogRecordType>(statementType), statement);
+                    }
+                }
+                if (reader.ok) {
+                    commitTransaction(statements);
+                }
+                break;
+            }
+            case LogRecordType::Load:
+                loadFromFile(name, name);
+                break;
+            case LogRecordType::Shard: {
+                std::string columnName = reader.readString();
+                uint32_t count = reader.read<uint32_t>();
+                if (reader.ok && count != 0) {
+                    shardTable(name, columnName, count);
+                }
+                break;
+            }
+            default:
+                return false;
+        }
+        return reader.ok && reader.pos == reader.end;
+    }
+
+    bool saveToFile(const std::string& filename) {
+        for (auto& entry : tables) {
+            if (!entry.second.loadAllColumns()) {
+                return false;
+            }
+        }
+
+        std::string tempName = filename + ".tmp";
+        std::FILE* file = std::fopen(tempName.c_str(), "wb");
+        if (file != nullptr) {
+            std::vector<char> fileBuffer(1 << 20);
+            std::setvbuf(file, fileBuffer.data(), _IOFBF, fileBuffer.size());
+            uint64_t cellsWritten = 0;
+            std::string line;
+            for (const auto& entry : tables) {
+                const Table& table = entry.second;
+                line = fmt::format("Table: {}\n", entry.first);
+                for (const auto& column : table.columns) {
+                    line += fmt::format("  {} ({})\n", column.name, columnTypeName(column.type));
+                }
+                std::fwrite(line.data(), 1, line.size(), file);
+                for (size_t row = 0; row < table.rowCount; ++row) {
+                    if (table.isDeleted(row)) {
+                        continue;
+                    }
+                    line = "  ";
+                    for (const auto& column : table.columns) {
+                        line += column.name;
+                        line += ": ";
+                        column.appendTo(line, row);
+                        line += ", ";
+                    }
+                    line += "\n";
+                    std::fwrite(line.data(), 1, line.size(), file);
+                    cellsWritten += table.columns.size();
+                    if ((row & 4095) == 0) {
+                        reportProgress(cellsWritten);
+                    }
+                }
+            }
+            // Written aside and renamed over the old file, which a kept copy
+            // of the write-ahead log may share.
+            bool written = !std::ferror(file) && std::fflush(file) == 0 && fsync(fileno(file)) == 0;
+            written = std::fclose(file) == 0 && written;
+            if (!written || std::rename(tempName.c_str(), filename.c_str()) != 0) {
+                std::remove(tempName.c_str());
+                report("Error: Unable to write {}\n", filename);
+                return false;
+            }
+            report("Database saved to {}\n", filename);
+            return true;
+        } else {
+            report("Error: Unable to open file for saving\n");
+            return false;
+        }
+    }
+
+    void writeColumnBlock(BinaryWriter& writer, const Column& column, const std::vector<size_t>& live) {
+        std::vector<char> bitmap(((live.size() + 7) / 8 + 7) / 8 * 8);
+        for (size_t i = 0; i < live.size(); ++i) {
+            if (column.nulls[live[i]]) {
+                bitmap[i / 8] |= static_cast<char>(1 << (i % 8));
+            }
+        }
+        writer.write(bitmap.data(), bitmap.size());
+
+        const size_t chunkRows = 4096;
+        std::vector<uint64_t> chunk;
+        chunk.reserve(chunkRows + 1);
+        switch (column.type) {
+            case ColumnType::Int:
+            case ColumnType::Double:
+                for (size_t start = 0; start < live.size(); start += chunkRows) {
+                    size_t end = std::min(live.size(), start + chunkRows);
+                    chunk.resize(end - start);
+                    for (size_t i = start; i < end; ++i) {
+                        if (column.type == ColumnType::Int) {
+                            std::memcpy(&chunk[i - start], &column.ints[live[i]], 8);
+                        } else {
+                            std::memcpy(&chunk[i - start], &column.doubles[live[i]], 8);
+                        }
+                    }
+                    writer.write(chunk.data(), chunk.size() * 8);
+                }
+                break;
+            case ColumnType::String: {
+                uint64_t blobOffset = 0;
+                writer.writeValue<uint64_t>(0);
+                for (size_t start = 0; start < live.size(); start += chunkRows) {
+                    size_t end = std::min(live.size(), start + chunkRows);
+                    chunk.clear();
+                    for (size_t i = start; i < end; ++i) {
+                        blobOffset += column.strings[live[i]].size();
+                        chunk.push_back(blobOffset);
+                    }
+                    writer.write(chunk.data(), chunk.size() * 8);
+                }
+                for (size_t row : live) {
+                    writer.write(column.strings[row].data(), column.strings[row].size());
+                }
+                break;
+            }
+        }
+    }
+
+    static void writeHeader(BinaryWriter& writer, const char* magic) {
+        writer.write(magic, sizeof(snapshotMagic));
+        writer.writeValue<uint32_t>(snapshotVersion);
+        writer.writeValue<uint32_t>(0);
+    }
+
+    static void writeFooter(BinaryWriter& writer, const std::string& directory, const char* magic) {
+        writer.align();
+        uint64_t directoryOffset = writer.offset;
+        writer.write(directory.data(), directory.size());
+        Checksum directoryChecksum;
+        directoryChecksum.update(directory.data(), directory.size());
+        writer.writeValue<uint64_t>(directoryOffset);
+        writer.writeValue<uint64_t>(directory.size());
+        writer.writeValue<uint64_t>(directoryChecksum.finish());
+        writer.writeValue<uint32_t>(snapshotVersion);
+        writer.writeValue<uint32_t>(0);
+        writer.write(magic, sizeof(snapshotMagic));
+    }
+
+    bool saveSnapshot(const std::string& filename) {
+        for (auto& entry : tables) {
+            if (!entry.second.canCopyBlocks() && !entry.second.loadAllColumns()) {
+                return false;
+            }
+        }
+
+        std::string tempName = filename + ".tmp";
+        std::FILE* file = std::fopen(tempName.c_str(), "wb");
+        if (file == nullptr) {
+            report("Error: Unable to open file for saving\n");
+            return false;
+        }
+        std::vector<char> fileBuffer(1 << 20);
+        std::setvbuf(file, fileBuffer.data(), _IOFBF, fileBuffer.size());
+
+        BinaryWriter writer(file);
+        writeHeader(writer, snapshotMagic);
+
+        uint64_t cellsWritten = 0;
+        std::string directory;
+        appendBinary<uint32_t>(directory, static_cast<uint32_t>(tables.size()));
+        for (const auto& entry : tables) {
+            const Table& table = entry.second;
+            appendBinary(directory, entry.first);
+            appendBinary<uint64_t>(directory, table.liveRows());
+            appendBinary<uint32_t>(directory, static_cast<uint32_t>(table.columns.size()));
+            std::vector<size_t> live;
+            live.reserve(table.liveRows());
+            for (size_t row = 0; row < table.rowCount; ++row) {
+                if (!table.isDeleted(row)) {
+                    live.push_back(row);
+                }
+            }
+            for (const auto& column : table.columns) {
+                writer.align();
+                uint64_t blockOffset = writer.offset;
+                Checksum checksum;
+                writer.checksum = &checksum;
+                if (column.isLoaded()) {
+                    writeColumnBlock(writer, column, live);
+                } else {
+                    writer.write(column.mapped[0].data, column.mapped[0].length);
+                }
+                writer.checksum = nullptr;
+
+                appendBinary(directory, column.name);
+                appendBinary<uint8_t>(directory, static_cast<uint8_t>(column.type));
+                appendBinary<uint64_t>(directory, blockOffset);
+                appendBinary<uint64_t>(directory, writer.offset - blockOffset);
+                appendBinary<uint64_t>(directory, column.isLoaded() ? checksum.finish() : column.mapped[0].checksum);
+
+                cellsWritten += table.liveRows();
+                reportProgress(cellsWritten);
+            }
+        }
+
+        writeFooter(writer, directory, snapshotMagic);
+
+        bool written = writer.ok && std::fflush(file) == 0 && fsync(fileno(file)) == 0;
+        written = std::fclose(file) == 0 && written;
+        if (!written || std::rename(tempName.c_str(), filename.c_str()) != 0) {
+            std::remove(tempName.c_str());
+            report("Error: Unable to write snapshot {}\n", filename);
+            return false;
+        }
+        report("Snapshot saved to {}\n", filename);
+        return true;
+    }
+
+    static std::shared_ptr<const Mapping> mapFile(const std::string& filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            report("Error: Unable to open file for loading\n");
+            return nullptr;
+        }
+        size_t length = static_cast<size_t>(info.st_size);
+        void* address = length >= snapshotHeaderSize + snapshotTrailerSize ? mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (address == MAP_FAILED) {
+            report("Error: Invalid snapshot {}\n", filename);
+            return nullptr;
+        }
+        return std::make_shared<const Mapping>(address, length);
+    }
+
+    static bool readDirectory(const Mapping& mapping, const char* magic, const std::string& filename, uint64_t& directoryOffset, uint64_t& directoryLength) {
+        const char* base = static_cast<const char*>(mapping.address);
+        size_t length = mapping.length;
+        ByteReader trailer(base + length - snapshotTrailerSize, base + length);
+        directoryOffset = trailer.read<uint64_t>();
+        directoryLength = trailer.read<uint64_t>();
+        uint64_t directoryChecksum = trailer.read<uint64_t>();
+        uint32_t version = trailer.read<uint32_t>();
+        ByteReader header(base + sizeof(snapshotMagic), base + snapshotHeaderSize);
+
+        if (std::memcmp(base, magic, sizeof(snapshotMagic)) != 0 || std::memcmp(base + length - sizeof(snapshotMagic), magic, sizeof(snapshotMagic)) != 0) {
+            report("Error: Invalid snapshot {}\n", filename);
+            return false;
+        }
+        if (version != snapshotVersion || header.read<uint32_t>() != snapshotVersion) {
+            report("Error: Unsupported snapshot version {} in {}\n", version, filename);
+            return false;
+        }
+
+        uint64_t dataEnd = length - snapshotTrailerSize;
+        Checksum checksum;
+        if (directoryOffset < snapshotHeaderSize || directoryOffset > dataEnd || directoryLength != dataEnd - directoryOffset) {
+            report("Error: Invalid snapshot {}\n", filename);
+            return false;
+        }
+        checksum.update(base + directoryOffset, directoryLength);
+        if (checksum.finish() != directoryChecksum) {
+            report("Error: Checksum mismatch in snapshot directory of {}\n", filename);
+            return false;
+        }
+        return true;
+    }
+
+    void loadSnapshot(const std::string& filename, const std::string& logged) {
+        std::shared_ptr<const Mapping> mapping = mapFile(filename);
+        uint64_t directoryOffset;
+        uint64_t directoryLength;
+        if (mapping == nullptr || !readDirectory(*mapping, snapshotMagic, filename, directoryOffset, directoryLength)) {
+            return;
+        }
+
+        const char* base = static_cast<const char*>(mapping->address);
+        ByteReader reader(base + directoryOffset, base + directoryOffset + directoryLength);
+        std::map<std::string, Table> loaded;
+        uint32_t tableCount = reader.read<uint32_t>();
+        for (uint32_t t = 0; t < tableCount && reader.ok; ++t) {
+            std::string tableName = reader.readString();
+            uint64_t rows = reader.read<uint64_t>();
+            uint32_t columnCount = reader.read<uint32_t>();
+            Table table(tableName, {});
+            for (uint32_t c = 0; c < columnCount && reader.ok; ++c) {
+                std::string columnName = reader.readString();
+                uint8_t type = reader.read<uint8_t>();
+                uint64_t offset = reader.read<uint64_t>();
+                uint64_t blockLength = reader.read<uint64_t>();
+                uint64_t blockChecksum = reader.read<uint64_t>();
+                if (type > static_cast<uint8_t>(ColumnType::String) || offset < snapshotHeaderSize || offset > directoryOffset || blockLength > directoryOffset - offset) {
+                    reader.ok = false;
+                    break;
+                }
+                Column column{columnName, static_cast<ColumnType>(type)};
+                column.mapped.push_back({mapping, base + offset, blockLength, blockChecksum, static_cast<size_t>(rows)});
+                table.columns.push_back(column);
+            }
+            table.rowCount = static_cast<size_t>(rows);
+            table.tombstones.assign((table.rowCount + 63) / 64, 0);
+            table.initVersions();
+            loaded[tableName] = std::move(table);
+        }
+        if (!reader.ok) {
+            report("Error: Invalid snapshot {}\n", filename);
+            return;
+        }
+
+        ExclusiveLock catalog(catalogLock);
+        if (!logStatement(logRecord(LogRecordType::Load, logged))) {
+            return;
+        }
+        for (auto& entry : loaded) {
+            shardedTables.erase(entry.first);
+            tables[entry.first] = std::move(entry.second);
+        }
+        report("Database loaded from {}\n", filename);
+    }
+
+    bool writeChunk(const std::string& path, const Table& table, size_t chunk) {
+        std::FILE* file = std::fopen(path.c_str(), "wb");
+        if (file == nullptr) {
+            report("Error: Unable to open {} for saving\n", path);
+            return false;
+        }
+        std::vector<char> fileBuffer(1 << 20);
+        std::setvbuf(file, fileBuffer.data(), _IOFBF, fileBuffer.size());
+
+        size_t begin = chunk * checkpointChunkRows;
+        size_t end = std::min(table.rowCount, begin + checkpointChunkRows);
+        std::vector<size_t> rows(end - begin);
+        for (size_t i = 0; i < rows.size(); ++i) {
+            rows[i] = begin + i;
+        }
+
+        BinaryWriter writer(file);
+        writeHeader(writer, chunkMagic);
+        std::string directory;
+        appendBinary<uint64_t>(directory, rows.size());
+        appendBinary<uint32_t>(directory, static_cast<uint32_t>(table.columns.size()));
+
+        std::vector<char> deleted((rows.size() + 63) / 64 * 8);
+        for (size_t i = 0; i < rows.size(); ++i) {
+            if (table.isDeleted(rows[i])) {
+                deleted[i / 8] |= static_cast<char>(1 << (i % 8));
+            }
+        }
+        Checksum deletedChecksum;
+        deletedChecksum.update(deleted.data(), deleted.size());
+        appendBinary<uint64_t>(directory, writer.offset);
+        appendBinary<uint64_t>(directory, deleted.size());
+        appendBinary<uint64_t>(directory, deletedChecksum.finish());
+        writer.write(deleted.data(), deleted.size());
+
+        for (const auto& column : table.columns) {
+            writer.align();
+            uint64_t blockOffset = writer.offset;
+            Checksum checksum;
+            writer.checksum = &checksum;
+            writeColumnBlock(writer, column, rows);
+            writer.checksum = nullptr;
+
+            appendBinary<uint8_t>(directory, static_cast<uint8_t>(column.type));
+            appendBinary<uint64_t>(directory, blockOffset);
+            appendBinary<uint64_t>(directory, writer.offset - blockOffset);
+            appendBinary<uint64_t>(directory, checksum.finish());
+        }
+        writeFooter(writer, directory, chunkMagic);
+
+        bool written = writer.ok && std::fflush(file) == 0 && fsync(fileno(file)) == 0;
+        written = std::fclose(file) == 0 && written;
+        if (!written) {
+            report("Error: Unable to write {}\n", path);
+        }
+        return written;
+    }
+
+    bool saveCheckpoint(const std::string& directory) {
+        for (const auto& pending : pendingChunks) {
+            if (!tables.at(pending.table).loadAllColumns()) {
+                return false;
+            }
+        }
+        uint64_t cellsWritten = 0;
+        for (const auto& pending : pendingChunks) {
+            const Table& table = tables.at(pending.table);
+            if (!writeChunk(directory + "/" + table.chunkFiles[pending.chunk], table, pending.chunk)) {
+                return false;
+            }
+            reportProgress(cellsWritten += std::min(checkpointChunkRows, table.rowCount - pending.chunk * checkpointChunkRows) * table.columns.size());
+        }
+
+        std::set<std::string> referenced;
+        std::string manifest;
+        appendBinary<uint64_t>(manifest, checkpointGeneration);
+        appendBinary<uint32_t>(manifest, static_cast<uint32_t>(tables.size()));
+        for (const auto& entry : tables) {
+            const Table& table = entry.second;
+            appendBinary(manifest, entry.first);
+            appendBinary<uint64_t>(manifest, table.rowCount);
+            appendBinary<uint32_t>(manifest, static_cast<uint32_t>(table.columns.size()));
+            for (const auto& column : table.columns) {
+                appendBinary(manifest, column.name);
+                appendBinary<uint8_t>(manifest, static_cast<uint8_t>(column.type));
+            }
+            appendBinary<uint32_t>(manifest, static_cast<uint32_t>(table.chunkFiles.size()));
+            for (const auto& chunkFile : table.chunkFiles) {
+                appendBinary(manifest, chunkFile);
+                referenced.insert(chunkFile);
+            }
+        }
+
+        std::string manifestPath = directory + "/" + manifestName;
+        std::string tempName = manifestPath + ".tmp";
+        std::FILE* file = std::fopen(tempName.c_str(), "wb");
+        if (file == nullptr) {
+            report("Error: Unable to open file for saving\n");
+            return false;
+        }
+        BinaryWriter writer(file);
+        writeHeader(writer, manifestMagic);
+        writeFooter(writer, manifest, manifestMagic);
+        bool written = writer.ok && std::fflush(file) == 0 && fsync(fileno(file)) == 0;
+        written = std::fclose(file) == 0 && written;
+        if (!written || !syncDirectory(directory) || std::rename(tempName.c_str(), manifestPath.c_str()) != 0 || !syncDirectory(directory)) {
+            std::remove(tempName.c_str());
+            report("Error: Unable to write checkpoint {}\n", directory);
+            return false;
+        }
+
+        DIR* listing = opendir(directory.c_str());
+        if (listing != nullptr) {
+            static const char suffix[] = ".chunk";
+            const size_t suffixLength = sizeof(suffix) - 1;
+            while (dirent* item = readdir(listing)) {
+                std::string fileName = item->d_name;
+                if (fileName.size() > suffixLength && fileName.compare(fileName.size() - suffixLength, suffixLength, suffix) == 0 && referenced.count(fileName) == 0) {
+                    std::remove((directory + "/" + fileName).c_str());
+                }
+            }
+            closedir(listing);
+        }
+        report("Checkpoint saved to {}\n", directory);
+        return true;
+    }
+
+    bool loadChunk(const std::string& path, Table& table, size_t chunk) {
+        std::shared_ptr<const Mapping> mapping = mapFile(path);
+        uint64_t directoryOffset;
+        uint64_t directoryLength;
+        if (mapping == nullptr || !readDirectory(*mapping, chunkMagic, path, directoryOffset, directoryLength)) {
+            return false;
+        }
+
+        const char* base = static_cast<const char*>(mapping->address);
+        ByteReader reader(base + directoryOffset, base + directoryOffset + directoryLength);
+        size_t begin = chunk * checkpointChunkRows;
+        size_t rows = std::min(table.rowCount, begin + checkpointChunkRows) - begin;
+        bool valid = reader.read<uint64_t>() == rows && reader.read<uint32_t>() == table.columns.size();
+
+        uint64_t deletedOffset = reader.read<uint64_t>();
+        uint64_t deletedLength = reader.read<uint64_t>();
+        uint64_t deletedChecksum = reader.read<uint64_t>();
+        valid = valid && reader.ok && deletedOffset >= snapshotHeaderSize && deletedOffset <= directoryOffset && deletedLength == (rows + 63) / 64 * 8 && deletedLength <= directoryOffset - deletedOffset;
+        if (!valid) {
+            report("Error: Invalid snapshot {}\n", path);
+            return false;
+        }
+        Checksum checksum;
+        checksum.update(base + deletedOffset, deletedLength);
+        if (checksum.finish() != deletedChecksum) {
+            report("Error: Checksum mismatch in {}\n", path);
+            return false;
+        }
+        for (size_t i = 0; i < rows; ++i) {
+            if (base[deletedOffset + i / 8] >> (i % 8) & 1) {
+                table.tombstones[(begin + i) / 64] |= uint64_t(1) << ((begin + i) % 64);
+                ++table.deletedCount;
+            }
+        }
+
+        for (auto& column : table.columns) {
+            uint8_t type = reader.read<uint8_t>();
+            uint64_t offset = reader.read<uint64_t>();
+            uint64_t blockLength = reader.read<uint64_t>();
+            uint64_t blockChecksum = reader.read<uint64_t>();
+            if (!reader.ok || type != static_cast<uint8_t>(column.type) || offset < snapshotHeaderSize || offset > directoryOffset || blockLength > directoryOffset - offset) {
+                report("Error: Invalid snapshot {}\n", path);
+                return false;
+            }
+            column.mapped.push_back({mapping, base + offset, blockLength, blockChecksum, rows});
+        }
+        return true;
+    }
+
+    void loadCheckpoint(const std::string& directory, const std::string& logged) {
+        std::string manifestPath = directory + "/" + manifestName;
+        std::shared_ptr<const Mapping> mapping = mapFile(manifestPath);
+        uint64_t directoryOffset;
+        uint64_t directoryLength;
+        if (mapping == nullptr || !readDirectory(*mapping, manifestMagic, manifestPath, directoryOffset, directoryLength)) {
+            return;
+        }
+
+        const char* base = static_cast<const char*>(mapping->address);
+        ByteReader reader(base + directoryOffset, base + directoryOffset + directoryLength);
+        uint64_t generation = reader.read<uint64_t>();
+        std::map<std::string, Table> loaded;
+        uint32_t tableCount = reader.read<uint32_t>();
+        for (uint32_t t = 0; t < tableCount && reader.ok; ++t) {
+            std::string tableName = reader.readString();
+            uint64_t rows = reader.read<uint64_t>();
+            uint32_t columnCount = reader.read<uint32_t>();
+            Table table(tableName, {});
+            for (uint32_t c = 0; c < columnCount && reader.ok; ++c) {
+                std::string columnName = reader.readString();
+                uint8_t type = reader.read<uint8_t>();
+                if (type > static_cast<uint8_t>(ColumnType::String)) {
+                    reader.ok = false;
+                    break;
+                }
+                table.columns.push_back({columnName, static_cast<ColumnType>(type)});
+            }
+            uint32_t chunkCount = reader.read<uint32_t>();
+            if (!reader.ok || chunkCount != (rows + checkpointChunkRows - 1) / checkpointChunkRows) {
+                reader.ok = false;
+                break;
+            }
+
+            table.rowCount = static_cast<size_t>(rows);
+            table.tombstones.assign((table.rowCount + 63) / 64, 0);
+            for (uint32_t chunk = 0; chunk < chunkCount && reader.ok; ++chunk) {
+                std::string chunkFile = reader.readString();
+                if (reader.ok && !loadChunk(directory + "/" + chunkFile, table, chunk)) {
+                    return;
+                }
+                table.chunkFiles.push_back(chunkFile);
+            }
+            table.dirtyChunks.assign(chunkCount, 0);
+            table.checkpointDirectory = directory;
+            table.initVersions();
+            loaded[tableName] = std::move(table);
+        }
+        if (!reader.ok) {
+            report("Error: Invalid snapshot {}\n", manifestPath);
+            return;
+        }
+
+        ExclusiveLock catalog(catalogLock);
+        if (!logStatement(logRecord(LogRecordType::Load, logged))) {
+            return;
+        }
+        checkpointGeneration = std::max(checkpointGeneration, generation);
+        for (auto& entry : loaded) {
+            shardedTables.erase(entry.first);
+            tables[entry.first] = std::move(entry.second);
+        }
+        report("Database loaded from {}\n", directory);
+    }
+
+    bool loadLine(const char* begin, const char* end, std::map<std::string, Table>& loaded, Table*& current) {
+        if (end > begin && end[-1] == '\r') {
+            --end;
+        }
+        if (begin == end) {
+            return true;
+        }
+
+        static const char tablePrefix[] = "Table: ";
+        const size_t tablePrefixLength = sizeof(tablePrefix) - 1;
+        if (static_cast<size_t>(end - begin) > tablePrefixLength && std::equal(tablePrefix, tablePrefix + tablePrefixLength, begin)) {
+            std::string tableName(begin + tablePrefixLength, end);
+            loaded[tableName] = Table(tableName, {});
+            current = &loaded[tableName];
+            return true;
+        }
+
+        if (current == nullptr || end - begin < 2 || begin[0] != ' ' || begin[1] != ' ') {
+            return false;
+        }
+        if (current->loadRow(begin + 2, end)) {
+            return true;
+        }
+        if (current->rowCount != 0 || end[-1] != ')') {
+            return false;
+        }
+
+        const char* open = end - 1;
+        while (open > begin + 2 && *open != '(') {
+            --open;
+        }
+        ColumnType type;
+        if (open - begin < 4 || open[-1] != ' ' || !parseColumnType(std::string(open + 1, end - 1), type)) {
+            return false;
+        }
+        std::string columnName(begin + 2, open - 1);
+        if (current->findColumn(columnName) != invalidColumn) {
+            return false;
+        }
+        current->addColumn({columnName, type});
+        return true;
+    }
+
+    // Loads filename and logs logged, a copy of it that the log keeps.
+    void loadFromFile(const std::string& filename, const std::string& logged) {
+        struct stat info;
+        if (stat(filename.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+            loadCheckpoint(filename, logged);
+            return;
+        }
+
+        std::FILE* file = std::fopen(filename.c_str(), "rb");
+        if (file == nullptr) {
+            report("Error: Unable to open file for loading\n");
+            return;
+        }
+
+        char magic[sizeof(snapshotMagic)];
+        if (std::fread(magic, 1, sizeof(magic), file) == sizeof(magic) && std::memcmp(magic, snapshotMagic, sizeof(magic)) == 0) {
+            std::fclose(file);
+            loadSnapshot(filename, logged);
+            return;
+        }
+        std::rewind(file);
+
+        std::map<std::string, Table> loaded;
+        Table* current = nullptr;
+        std::vector<char> buffer(1 << 20);
+        size_t carry = 0;
+        size_t lineNumber = 0;
+        bool valid = true;
+
+        while (valid) {
+            size_t read = std::fread(buffer.data() + carry, 1, buffer.size() - carry, file);
+            char* pos = buffer.data();
+            char* limit = pos + carry + read;
+
+            if (read == 0) {
+                if (pos != limit) {
+                    ++lineNumber;
+                    valid = loadLine(pos, limit, loaded, current);
+                }
+                break;
+            }
+
+            while (valid) {
+                char* newline = static_cast<char*>(std::memchr(pos, '\n', limit - pos));
+                if (newline == nullptr) {
+                    break;
+                }
+                ++lineNumber;
+                valid = loadLine(pos, newline, loaded, current);
+                pos = newline + 1;
+            }
+
+            carry = limit - pos;
+            std::memmove(buffer.data(), pos, carry);
+            if (carry == buffer.size()) {
+                buffer.resize(buffer.size() * 2);
+            }
+        }
+
+        bool readError = std::ferror(file) != 0;
+        std::fclose(file);
+        if (readError) {
+            report("Error: Unable to read {}\n", filename);
+            return;
+        }
+        if (!valid) {
+            report("Error: Invalid line {} in {}\n", lineNumber, filename);
+            return;
+        }
+
+        ExclusiveLock catalog(catalogLock);
+        if (!logStatement(logRecord(LogRecordType::Load, logged))) {
+            return;
+        }
+        for (auto& entry : loaded) {
+            shardedTables.erase(entry.first);
+            tables[entry.first] = std::move(entry.second);
+        }
+        report("Database loaded from {}\n", filename);
+    }
+
+public:
+    explicit SimpleDatabase(size_t workers) : scheduler(new Scheduler(workers)) {
+        taskScheduler = scheduler.get();
+    }
+
+    ~SimpleDatabase() {
+        taskScheduler = nullptr;
+    }
+
+    void createTable(const std::string& tableName, const std::vector<Column>& columns) {
+        ExclusiveLock catalog(catalogLock);
+        std::string record = logRecord(LogRecordType::CreateTable, tableName);
+        appendBinary<uint32_t>(record, static_cast<uint32_t>(columns.size()));
+        for (const auto& column : columns) {
+            appendBinary(record, column.name);
+            appendBinary<uint8_t>(record, static_cast<uint8_t>(column.type));
+        }
+        if (!logStatement(record)) {
+            return;
+        }
+
+        Table table(tableName, columns);
+        shardedTables.erase(tableName);
+        tables[tableName] = std::move(table);
+        report("Table {} created\n", tableName);
+    }
+
+    void addColumnToTable(const std::string& tableName, const Column& newColumn) {
+        SharedLock catalog(catalogLock);
+        auto it = tables.find(tableName);
+        if (it != tables.end()) {
+            std::lock_guard<std::mutex> writer(it->second.latch->writerLock);
+            ExclusiveLock tableLock(it->second.latch->lock);
+            if (it->second.findColumn(newColumn.name) == invalidColumn) {
+                std::string record = logRecord(LogRecordType::AddColumn, tableName);
+                appendBinary(record, newColumn.name);
+                appendBinary<uint8_t>(record, static_cast<uint8_t>(newColumn.type));
+                if (!logStatement(record)) {
+                    return;
+                }
+
+                it->second.addColumn(newColumn);
+                ShardSet* shards = findShards(tableName);
+                if (shards != nullptr) {
+                    ExclusiveLock writes(shards->writeLatch);
+                    onShards(*shards, nullptr, [&newColumn](Table& shard, size_t) {
+                        shard.addColumn(newColumn);
+                    });
+                }
+                report("Column {} added to table {}\n", newColumn.name, tableName);
+            } else {
+                report("Error: Column {} already exists in table {}\n", newColumn.name, tableName);
+            }
+        } else {
+            report("Error: Table {} not found\n", tableName);
+        }
+    }
+
+    void createIndex(const std::string& tableName, const std::string& columnName, bool ordered) {
+        SharedLock catalog(catalogLock);
+        auto it = tables.find(tableName);
+        if (it != tables.end()) {
+            std::lock_guard<std::mutex> writer(it->second.latch->writerLock);
+            ExclusiveLock tableLock(it->second.latch->lock);
+            size_t column = it->second.findColumn(columnName);
+            if (column == invalidColumn) {
+                report("Error: Column {} not found in table {}\n", columnName, tableName);
+            } else if (ordered ? it->second.findOrderedIndex(column) != nullptr : it->second.findIndex(column) != nullptr) {
+                report("Error: Index on column {} already exists in table {}\n", columnName, tableName);
+            } else if (it->second.loadColumn(column)) {
+                std::string record = logRecord(LogRecordType::CreateIndex, tableName);
+                appendBinary(record, columnName);
+                appendBinary<uint8_t>(record, ordered);
+                if (!logStatement(record)) {
+                    return;
+                }
+
+                if (ordered) {
+                    it->second.createOrderedIndex(column);
+                } else {
+                    it->second.createIndex(column);
+                }
+                ShardSet* shards = findShards(tableName);
+                if (shards != nullptr) {
+                    ExclusiveLock writes(shards->writeLatch);
+                    onShards(*shards, nullptr, [column, ordered](Table& shard, size_t) {
+                        if (ordered) {
+                            shard.createOrderedIndex(column);
+                        } else {
+                            shard.createIndex(column);
+                        }
+                    });
+                }
+                report("Index created on column {} of table {}\n", columnName, tableName);
+            }
+        } else {
+            report("Error: Table {} not found\n", tableName);
+        }
+    }
+
+    void insertData(const std::string& tableName, const std::map<std::string, std::string>& data) {
+        SharedLock catalog(catalogLock);
+        auto it = tables.find(tableName);
+        if (it != tables.end()) {
+            Table& table = it->second;
+            std::string record = writeRecord(LogRecordType::Insert, tableName, data, nullptr);
+            ShardSet* shards = findShards(tableName);
+            if (shards != nullptr) {
+                std::vector<Value> values;
+                if (!table.bindRow(data, values) || !writeShards(*shards, &values[shards->keyColumn], record, [&values](Table& shard) {
+                    shard.appendRow(values, 0);
+                })) {
+                    return;
+                }
+                report("Data inserted into table {}\n", tableName);
+                return;
+            }
+
+            std::lock_guard<std::mutex> writer(table.latch->writerLock);
+            std::vector<Value> values;
+            if (!table.bindRow(data, values)) {
+                return;
+            }
+            ExclusiveLock tableLock(table.latch->lock);
+            if (!table.loadAllColumns()) {
+                return;
+            }
+            tableLock.unlock();
+
+            if (!logStatement(record)) {
+                return;
+            }
+            tableLock.lock();
+            installVersion([&table, &values](uint64_t version) {
+                table.appendRow(values, version);
+                return true;
+            });
+            tableLock.unlock();
+            report("Data inserted into table {}\n", tableName);
+        } else {
+            report("Error: Table {} not found\n", tableName);
+        }
+    }
+
+    void updateData(const std::string& tableName, const std::map<std::string, std::string>& updateData, const Expr* whereClause) {
+        SharedLock catalog(catalogLock);
+        auto it = tables.find(tableName);
+
+        if (it != tables.end()) {
+            Table& table = it->second;
+            std::string record = writeRecord(LogRecordType::Update, tableName, updateData, whereClause);
+            ShardSet* shards = findShards(tableName);
+            if (shards != nullptr) {
+                BoundStatement statement;
+                if (!table.bindWhere(whereClause, statement) || !table.bindAssignments(updateData, statement)) {
+                    return;
+                }
+                for (const auto& assignment : statement.assignments) {
+                    if (assignment.column == shards->keyColumn) {
+                        report("Error: Cannot update shard key column {} of table {}\n", table.columns[assignment.column].name, tableName);
+                        return;
+                    }
+                }
+                if (!writeShards(*shards, shardKey(*shards, statement), record, [&statement](Table& shard) {
+                    std::vector<size_t> rows;
+                    collectRows(shard, statement, rows);
+                    for (size_t row : rows) {
+                        shard.updateRow(row, statement.assignments, 0);
+                    }
+                    if (shard.needsCompaction()) {
+                        shard.compact(latestVersion);
+                    }
+                })) {
+                    return;
+                }
+                report("Data updated in table {}\n", tableName);
+                return;
+            }
+
+            std::lock_guard<std::mutex> writer(table.latch->writerLock);
+            ExclusiveLock tableLock(table.latch->lock);
+            BoundStatement statement;
+            if (!table.bindWhere(whereClause, statement) || !table.bindAssignments(updateData, statement) || !table.loadAllColumns()) {
+                return;
+            }
+            tableLock.unlock();
+
+            std::vector<size_t> rows = findRows(table, statement);
+            if (!logStatement(record)) {
+                return;
+            }
+            tableLock.lock();
+            installVersion([&table, &rows, &statement](uint64_t version) {
+                for (size_t row : rows) {
+                    table.updateRow(row, statement.assignments, version);
+                }
+                return true;
+            });
+            compactIfNeeded(table);
+            tableLock.unlock();
+
+            report("Data updated in table {}\n", tableName);
+        } else {
+            report("Error: Table {} not found\n", tableName);
+        }
+    }
+
+    void deleteData( std::string& tableName, const Expr* whereClause) {
+        SharedLock catalog(catalogLock);
+        auto it = tables.find(tableName);
+
+        if (it != tables.end()) {
+            Table& table = it->second;
+            std::string record = writeRecord(LogRecordType::Delete, tableName, {}, whereClause);
+            ShardSet* shards = findShards(tableName);
+            if (shards != nullptr) {
+                BoundStatement statement;
+                if (!table.bindWhere(whereClause, statement) || !writeShards(*shards, shardKey(*shards, statement), record, [&statement](Table& shard) {
+                    std::vector<size_t> rows;
+                    collectRows(shard, statement, rows);
+                    for (size_t row : rows) {
+                        shard.deleteRow(row, 0);
+                    }
+                    if (shard.needsCompaction()) {
+                        shard.compact(latestVersion);
+                    }
+                })) {
+                    return;
+                }
+                report("Data deleted from table {}\n", tableName);
+                return;
+            }
+
+            std::lock_guard<std::mutex> writer(table.latch->writerLock);
+            ExclusiveLock tableLock(table.latch->lock);
+            BoundStatement statement;
+            if (!table.bindWhere(whereClause, statement) || !table.loadColumns(statement)) {
+                return;
+            }
+            tableLock.unlock();
+
+            std::vector<size_t> rows = findRows(table, statement);
+            if (!logStatement(record)) {
+                return;
+            }
+            tableLock.lock();
+            installVersion([&table, &rows](uint64_t version) {
+                for (size_t row : rows) {
+                    table.deleteRow(row, version);
+                }
+                return true;
+            });
+            compactIfNeeded(table);
+            tableLock.unlock();
+
+            report("Data deleted from table {}\n", tableName);
+        } else {
+            report("Error: Table {} not found\n", tableName);
+        }
+    }
+
+    // Output order of a result set: by statement.orderBy when there is one,
+    // then offset and limit.
+    std::vector<size_t> resultRows(const std::vector<Column>& result, const BoundStatement& statement) {
+        size_t rows = result.empty() ? 0 : result[0].nulls.size();
+        std::vector<size_t> order;
+        if (statement.orderBy != invalidColumn) {
+            TopRows top(result, statement.orderBy, statement.descending, statement.wantedRows());
+            for (size_t row = 0; row < rows; ++row) {
+                top.add(row);
+            }
+            order = top.finish();
+        } else {
+            for (size_t row = 0; row < rows && row < statement.wantedRows(); ++row) {
+                order.push_back(row);
+            }
+        }
+        order.erase(order.begin(), order.begin() + std::min(order.size(), statement.offset));
+        return order;
+    }
+
+    void writeResult(const std::vector<Column>& result, const std::vector<size_t>& rows) {
+        std::vector<size_t> projection;
+        for (size_t i = 0; i < result.size(); ++i) {
+            projection.push_back(i);
+        }
+        FrameWriter* frames = frameOutput;
+        if (frames != nullptr) {
+            frames->columns(result, projection);
+            for (size_t row : rows) {
+                frames->row(result, projection, row);
+            }
+            frames->flushRows();
+            return;
+        }
+
+        std::string out;
+        for (const auto& column : result) {
+            out += column.name;
+            out += '\t';
+        }
+        out += '\n';
+        for (size_t row : rows) {
+            for (const auto& column : result) {
+                column.appendTo(out, row);
+                out += '\t';
+            }
+            out += '\n';
+        }
+        writeOutput(out);
+    }
+
+    // Each scan slot aggregates its morsels into its own table. Slots are
+    // merged into the result in morsel order, so groups come out in the order
+    // their first row appears in the table.
+    bool aggregate(const Table& table, const BoundStatement& statement, SharedLock& tableLock) {
+        GroupTable result(table.columns, statement);
+        std::vector<GroupTable> partials(scanSlots(), GroupTable(table.columns, statement));
+        parallelScan(table, statement, &tableLock, [&partials](size_t slot, size_t row) {
+            partials[slot].add(row);
+        }, [&result, &partials](size_t slot) {
+            result.merge(partials[slot]);
+            partials[slot].clear();
+        });
+
+        std::vector<Column> rows;
+        if (!result.finish(rows)) {
+            return false;
+        }
+        writeResult(rows, resultRows(rows, statement));
+        return true;
+    }
+
+    // Rows of a query with order by, limit or offset, in output order. Each
+    // scan slot keeps its own top rows, or without order by just its first
+    // rows, and the slots are merged in morsel order.
+    std::vector<size_t> orderedRows(const Table& table, const BoundStatement& statement, SharedLock* yield) {
+        size_t wanted = statement.wantedRows();
+        std::vector<size_t> rows;
+        if (statement.orderBy == invalidColumn) {
+            std::vector<std::vector<size_t>> partials(scanSlots());
+            parallelScan(table, statement, yield, [&partials](size_t slot, size_t row) {
+                partials[slot].push_back(row);
+            }, [&rows, &partials, wanted](size_t slot) {
+                for (size_t i = 0; i < partials[slot].size() && rows.size() < wanted; ++i) {
+                    rows.push_back(partials[slot][i]);
+                }
+                partials[slot].clear();
+            }, wanted);
+        } else {
+            TopRows top(table.columns, statement.orderBy, statement.descending, wanted);
+            std::vector<TopRows> partials(scanSlots(), top);
+            parallelScan(table, statement, yield, [&partials](size_t slot, size_t row) {
+                partials[slot].add(row);
+            }, [&top, &partials](size_t slot) {
+                top.merge(partials[slot]);
+            });
+            rows = top.finish();
+        }
+        rows.erase(rows.begin(), rows.begin() + std::min(rows.size(), statement.offset));
+        return rows;
+    }
+
+    // Each shard picks and encodes its own top rows along with their order
+    // key; the coordinator merges them by key, ties in shard order.
+    void queryShardedOrdered(const Table& table, ShardSet& shards, const BoundStatement& statement) {
+        FrameWriter* frames = frameOutput;
+        std::vector<std::vector<std::pair<Value, std::string>>> picked(shards.workers.size());
+        onShards(shards, shardKey(shards, statement), [&statement, &picked, frames](Table& shard, size_t i) {
+            std::vector<size_t> rows;
+            if (statement.orderBy == invalidColumn) {
+                shard.forEachMatch(statement, [&rows](size_t row) {
+                    rows.push_back(row);
+                }, nullptr, statement.wantedRows());
+            } else {
+                TopRows top(shard.columns, statement.orderBy, statement.descending, statement.wantedRows());
+                shard.forEachMatch(statement, [&top](size_t row) {
+                    top.add(row);
+                });
+                rows = top.finish();
+            }
+            for (size_t row : rows) {
+                Value key = statement.orderBy != invalidColumn ? shard.columns[statement.orderBy].valueAt(row) : Value();
+                std::string encoded;
+                if (frames != nullptr) {
+                    for (size_t column : statement.projection) {
+                        shard.columns[column].appendBinaryTo(encoded, row);
+                    }
+                } else {
+                    shard.formatRow(encoded, statement.projection, row);
+                }
+                picked[i].emplace_back(std::move(key), std::move(encoded));
+            }
+        });
+
+        std::vector<const std::pair<Value, std::string>*> merged;
+        for (const auto& rows : picked) {
+            for (const auto& row : rows) {
+                merged.push_back(&row);
+            }
+        }
+        if (statement.orderBy != invalidColumn) {
+            ColumnType type = table.columns[statement.orderBy].type;
+            bool descending = statement.descending;
+            std::stable_sort(merged.begin(), merged.end(), [type, descending](const std::pair<Value, std::string>* left, const std::pair<Value, std::string>* right) {
+                const Value& a = left->first;
+                const Value& b = right->first;
+                int order = a.isNull || b.isNull ? a.isNull - b.isNull : compareValues(type, a, b);
+                return descending ? order > 0 : order < 0;
+            });
+        }
+
+        size_t end = std::min(merged.size(), statement.wantedRows());
+        if (frames != nullptr) {
+            frames->columns(table.columns, statement.projection);
+            for (size_t i = statement.offset; i < end; ++i) {
+                frames->encodedRow(merged[i]->second);
+            }
+            frames->flushRows();
+        } else {
+            std::string out = table.formatHeader(statement.projection);
+            for (size_t i = statement.offset; i < end; ++i) {
+                out += merged[i]->second;
+            }
+            writeOutput(out);
+        }
+    }
+
+    // Each shard formats its own matches; the results are sent in shard order.
+    bool querySharded(const Table& table, ShardSet& shards, const QueryStatement& query) {
+        BoundStatement statement;
+        if (!table.bindSelect(query.select, query.groupBy, statement) || !table.bindWhere(query.where.get(), statement) || !table.bindOrder(query, statement)) {
+            return false;
+        }
+
+        if (statement.isAggregate()) {
+            std::vector<GroupTable> partials(shards.workers.size(), GroupTable(table.columns, statement));
+            onShards(shards, shardKey(shards, statement), [&statement, &partials](Table& shard, size_t i) {
+                GroupTable& partial = partials[i];
+                partial = GroupTable(shard.columns, statement);
+                shard.forEachMatch(statement, [&partial](size_t row) {
+                    partial.add(row);
+                });
+            });
+            GroupTable result(table.columns, statement);
+            for (const auto& partial : partials) {
+                result.merge(partial);
+            }
+            std::vector<Column> rows;
+            if (!result.finish(rows)) {
+                return false;
+            }
+            writeResult(rows, resultRows(rows, statement));
+            return true;
+        }
+        if (statement.isOrdered()) {
+            queryShardedOrdered(table, shards, statement);
+            return true;
+        }
+
+        FrameWriter* frames = frameOutput;
+        std::vector<std::string> results(shards.workers.size());
+        onShards(shards, shardKey(shards, statement), [&statement, &results, frames](Table& shard, size_t i) {
+            std::string& out = results[i];
+            if (frames != nullptr) {
+                FrameWriter shardFrames(out, frames->statement);
+                shard.forEachMatch(statement, [&shard, &statement, &shardFrames](size_t row) {
+                    shardFrames.row(shard.columns, statement.projection, row);
+                });
+                shardFrames.flushRows();
+            } else {
+                shard.forEachMatch(statement, [&shard, &statement, &out](size_t row) {
+                    shard.formatRow(out, statement.projection, row);
+                });
+            }
+        });
+
+        if (frames != nullptr) {
+            frames->columns(table.columns, statement.projection);
+        } else {
+            writeOutput(table.formatHeader(statement.projection));
+        }
+        for (const auto& result : results) {
+            if (frames != nullptr) {
+                frames->append(result);
+            } else {
+                writeOutput(result);
+            }
+        }
+        return true;
+    }
+
+    // Which table of a join a column belongs to: 0 for the left, 1 for the
+    // right, -1 if neither has it. Qualified names pick their table; plain
+    // ones are looked up on the left first, or on the right when preferRight.
+    static int joinSide(const std::string& columnName, const Table& left, const Table& right, size_t& column, bool preferRight = false) {
+        bool qualifiedLeft = columnName.compare(0, left.name.size() + 1, left.name + ".") == 0;
+        if (preferRight && !qualifiedLeft) {
+            column = right.findColumn(columnName);
+            if (column != invalidColumn) {
+                return 1;
+            }
+        }
+        bool qualifiedRight = columnName.compare(0, right.name.size() + 1, right.name + ".") == 0;
+        if (!qualifiedRight || left.name == right.name) {
+            column = left.findColumn(columnName);
+            if (column != invalidColumn) {
+                return 0;
+            }
+        }
+        column = right.findColumn(columnName);
+        return column != invalidColumn ? 1 : -1;
+    }
+
+    static bool exprSide(const Expr& expr, const Table& left, const Table& right, int& side) {
+        for (const auto& child : expr.children) {
+            if (!exprSide(*child, left, right, side)) {
+                return false;
+            }
+        }
+        if (expr.columnName.empty()) {
+            return true;
+        }
+        size_t column;
+        int found = joinSide(expr.columnName, left, right, column);
+        if (found < 0) {
+            report("Error: Column {} not found in table {} or {}\n", expr.columnName, left.name, right.name);
+            return false;
+        }
+        if (side >= 0 && side != found) {
+            report("Error: Each where condition of a join must use columns of one table\n");
+            return false;
+        }
+        side = found;
+        return true;
+    }
+
+    // Matching rows of both tables are collected with parallel scans. The
+    // smaller side is put in a JoinTable and the larger one probes it in
+    // parallel chunks. Pairs come out in the order of the left table, then
+    // of the right.
+    void join(const QueryStatement& query) {
+        SharedLock catalog(catalogLock);
+        auto leftIt = tables.find(query.table);
+        auto rightIt = tables.find(query.join);
+        if (leftIt == tables.end() || rightIt == tables.end()) {
+            report("Error: Table {} not found\n", leftIt == tables.end() ? query.table : query.join);
+            return;
+        }
+        Table& left = leftIt->second;
+        Table& right = rightIt->second;
+        if (findShards(query.table) != nullptr || findShards(query.join) != nullptr) {
+            report("Error: Cannot join sharded table {}\n", findShards(query.table) != nullptr ? query.table : query.join);
+            return;
+        }
+        if (!query.groupBy.empty() || !query.orderBy.empty()) {
+            report("Error: Joins do not support group by or order by\n");
+            return;
+        }
+
+        Table* sides[2] = {&left, &right};
+        BoundStatement statements[2];
+        std::vector<std::pair<int, size_t>> output;
+        for (const auto& item : query.select) {
+            size_t column;
+            int side = joinSide(item, left, right, column);
+            if (side < 0) {
+                report("Error: Column {} not found in table {} or {}\n", item, left.name, right.name);
+                return;
+            }
+            output.emplace_back(side, column);
+            statements[side].projection.push_back(column);
+        }
+        if (query.select.empty()) {
+            for (int side = 0; side < 2; ++side) {
+                for (size_t column = 0; column < sides[side]->columns.size(); ++column) {
+                    output.emplace_back(side, column);
+                    statements[side].projection.push_back(column);
+                }
+            }
+        }
+
+        size_t keys[2];
+        int leftKey = joinSide(query.joinLeft, left, right, keys[0]);
+        int rightKey = joinSide(query.joinRight, left, right, keys[1], true);
+        if (leftKey < 0 || rightKey < 0) {
+            report("Error: Column {} not found in table {} or {}\n", leftKey < 0 ? query.joinLeft : query.joinRight, left.name, right.name);
+            return;
+        }
+        if (leftKey == rightKey) {
+            if (left.name != right.name) {
+                report("Error: A join condition needs a column from each table\n");
+                return;
+            }
+            rightKey = 1;
+        }
+        if (leftKey == 1) {
+            std::swap(keys[0], keys[1]);
+        }
+        if (left.columns[keys[0]].type != right.columns[keys[1]].type) {
+            report("Error: Cannot join {} column {} with {} column {}\n", columnTypeName(left.columns[keys[0]].type), left.columns[keys[0]].name,
+                   columnTypeName(right.columns[keys[1]].type), right.columns[keys[1]].name);
+            return;
+        }
+
+        std::vector<const Expr*> terms[2];
+        std::vector<const Expr*> conjuncts;
+        Table::conjuncts(query.where.get(), conjuncts);
+        for (const Expr* term : conjuncts) {
+            int side = -1;
+            if (!exprSide(*term, left, right, side)) {
+                return;
+            }
+            terms[std::max(side, 0)].push_back(term);
+        }
+        for (int side = 0; side < 2; ++side) {
+            statements[side].projection.push_back(keys[side]);
+            if (!sides[side]->bindWhere(terms[side], statements[side])) {
+                return;
+            }
+            if (!sides[side]->columnsLoaded(statements[side])) {
+                ExclusiveLock loadLock(sides[side]->latch->lock);
+                if (!sides[side]->loadColumns(statements[side])) {
+                    return;
+                }
+            }
+        }
+
+        // Shared locks are taken in name order, like the exclusive ones of a
+        // transaction. The scans must not yield: dropping one latch while
+        // holding the other would let a commit take the first and wait on
+        // the second, and the writer-preferring latch would then block the
+        // scan from taking the first back.
+        bool same = &left == &right;
+        bool rightFirst = right.name < left.name;
+        SharedLock firstLock((rightFirst ? right : left).latch->lock);
+        SharedLock secondLock;
+        if (!same) {
+            secondLock = SharedLock((rightFirst ? left : right).latch->lock);
+        }
+
+        statements[0].snapshot = beginSnapshot(left);
+        uint64_t rightSnapshot = beginSnapshot(right);
+        statements[1].snapshot = statements[0].snapshot;
+        std::vector<size_t> rows[2] = {orderedRows(left, statements[0], nullptr), orderedRows(right, statements[1], nullptr)};
+
+        int build = rows[1].size() <= rows[0].size() ? 1 : 0;
+        int probe = 1 - build;
+        JoinTable table(sides[build]->columns[keys[build]], rows[build], *scheduler);
+        const Column& probeKey = sides[probe]->columns[keys[probe]];
+        // Probing from the left yields pairs in output order, so the probe runs
+        // in waves of morsels and stops once it has offset + limit pairs.
+        // Probing from the right, only the first offset + limit pairs in left
+        // order are kept as they are found.
+        size_t wanted = query.limit == noLimit ? noLimit : query.offset + query.limit;
+        auto trim = [wanted](std::vector<std::pair<size_t, size_t>>& found) {
+            if (wanted != noLimit && found.size() / 2 >= wanted) {
+                std::nth_element(found.begin(), found.begin() + wanted, found.end());
+                found.resize(wanted);
+            }
+        };
+        size_t morsels = (rows[probe].size() + morselRows - 1) / morselRows;
+        std::vector<std::vector<std::pair<size_t, size_t>>> chunks(scanSlots());
+        std::vector<std::pair<size_t, size_t>> pairs;
+        for (size_t wave = 0; wave < morsels && (probe == 1 || pairs.size() < wanted); wave += chunks.size()) {
+            size_t count = std::min(chunks.size(), morsels - wave);
+            scheduler->parallelFor(count, [&table, &probeKey, &rows, &chunks, &trim, probe, wave, wanted](size_t slot) {
+                std::vector<std::pair<size_t, size_t>>& found = chunks[slot];
+                size_t end = std::min(rows[probe].size(), (wave + slot + 1) * morselRows);
+                for (size_t i = (wave + slot) * morselRows; i < end && (probe == 1 || found.size() < wanted); ++i) {
+                    size_t row = rows[probe][i];
+                    table.probe(probeKey, row, [&found, probe, row](size_t match) {
+                        found.emplace_back(probe == 0 ? row : match, probe == 0 ? match : row);
+                    });
+                    if (probe == 1) {
+                        trim(found);
+                    }
+                }
+            });
+            for (size_t slot = 0; slot < count; ++slot) {
+                pairs.insert(pairs.end(), chunks[slot].begin(), chunks[slot].end());
+                chunks[slot].clear();
+            }
+            if (probe == 1) {
+                trim(pairs);
+            }
+        }
+        if (probe == 1) {
+            std::sort(pairs.begin(), pairs.end());
+        }
+
+        size_t begin = std::min(pairs.size(), query.offset);
+        size_t end = query.limit == noLimit ? pairs.size() : std::min(pairs.size(), begin + std::min(query.limit, pairs.size()));
+        FrameWriter* frames = frameOutput;
+        std::string out;
+        std::vector<Column> header(output.size());
+        for (size_t i = 0; i < output.size(); ++i) {
+            const Column& column = sides[output[i].first]->columns[output[i].second];
+            header[i].name = column.name;
+            header[i].type = column.type;
+            if (left.findColumn(column.name) != invalidColumn && right.findColumn(column.name) != invalidColumn) {
+                header[i].name = sides[output[i].first]->name + "." + column.name;
+            }
+        }
+        if (frames != nullptr) {
+            std::vector<size_t> projection;
+            for (size_t i = 0; i < header.size(); ++i) {
+                projection.push_back(i);
+            }
+            frames->columns(header, projection);
+        } else {
+            for (const auto& column : header) {
+                out += column.name;
+                out += '\t';
+            }
+            out += '\n';
+        }
+        for (size_t i = begin; i < end; ++i) {
+            size_t pair[2] = {pairs[i].first, pairs[i].second};
+            if (frames != nullptr) {
+                frames->beginRow();
+                for (const auto& item : output) {
+                    sides[item.first]->columns[item.second].appendBinaryTo(frames->out, pair[item.first]);
+                }
+                frames->endRow();
+                continue;
+            }
+            for (const auto& item : output) {
+                sides[item.first]->columns[item.second].appendTo(out, pair[item.first]);
+                out += '\t';
+            }
+            out += '\n';
+            if (out.size() >= rowsFrameSize) {
+                writeOutput(out);
+                out.clear();
+            }
+        }
+        if (frames != nullptr) {
+            frames->flushRows();
+        } else {
+            writeOutput(out);
+        }
+        endSnapshot(right, rightSnapshot);
+        endSnapshot(left, statements[0].snapshot);
+
+        report("Query executed for tables {} and {}\n", left.name, right.name);
+    }
+
+    void query(const QueryStatement& query) {
+        if (!query.join.empty()) {
+            join(query);
+            return;
+        }
+        SharedLock catalog(catalogLock);
+        auto it = tables.find(query.table);
+
+        if (it != tables.end()) {
+            Table& table = it->second;
+            ShardSet* shards = findShards(query.table);
+            if (shards != nullptr) {
+                if (querySharded(table, *shards, query)) {
+                    report("Query executed for table {}\n", query.table);
+                }
+                return;
+            }
+
+            SharedLock tableLock(table.latch->lock);
+            BoundStatement statement;
+            if (!table.bindSelect(query.select, query.groupBy, statement) || !table.bindWhere(query.where.get(), statement) || !table.bindOrder(query, statement)) {
+                return;
+            }
+            if (!table.columnsLoaded(statement)) {
+                tableLock.unlock();
+                ExclusiveLock loadLock(table.latch->lock);
+                if (!table.loadColumns(statement)) {
+                    return;
+                }
+                loadLock.unlock();
+                tableLock.lock();
+            }
+
+            statement.snapshot = beginSnapshot(table);
+            bool executed = true;
+            if (statement.isAggregate()) {
+                executed = aggregate(table, statement, tableLock);
+            } else if (statement.isOrdered()) {
+                std::vector<size_t> rows = orderedRows(table, statement, &tableLock);
+                FrameWriter* frames = frameOutput;
+                if (frames != nullptr) {
+                    frames->columns(table.columns, statement.projection);
+                    for (size_t row : rows) {
+                        frames->row(table.columns, statement.projection, row);
+                    }
+                    frames->flushRows();
+                } else {
+                    std::string out = table.formatHeader(statement.projection);
+                    for (size_t row : rows) {
+                        table.formatRow(out, statement.projection, row);
+                    }
+                    writeOutput(out);
+                }
+            } else {
+                scanQuery(table, statement, tableLock);
+            }
+            endSnapshot(table, statement.snapshot);
+
+            if (executed) {
+                report("Query executed for table {}\n", query.table);
+            }
+        } else {
+            report("Error: Table {} not found\n", query.table);
+        }
+    }
+
+    void scanQuery(const Table& table, const BoundStatement& statement, SharedLock& tableLock) {
+        FrameWriter* frames = frameOutput;
+        std::vector<std::string> results(scanSlots());
+        std::vector<FrameWriter> writers;
+        if (frames != nullptr) {
+            frames->columns(table.columns, statement.projection);
+            writers.reserve(results.size());
+            for (auto& result : results) {
+                writers.emplace_back(result, frames->statement);
+            }
+        } else {
+            writeOutput(table.formatHeader(statement.projection));
+        }
+
+        parallelScan(table, statement, &tableLock, [&table, &statement, &results, &writers, frames](size_t slot, size_t row) {
+            if (frames != nullptr) {
+                writers[slot].row(table.columns, statement.projection, row);
+            } else {
+                table.formatRow(results[slot], statement.projection, row);
+            }
+        }, [&results, &writers, frames](size_t slot) {
+            if (frames != nullptr) {
+                writers[slot].flushRows();
+                frames->append(results[slot]);
+            } else {
+                writeOutput(results[slot]);
+            }
+            results[slot].clear();
+        });
+    }
+
+
+    bool commitTransaction(const std::vector<WriteStatement>& statements) {
+        SharedLock catalog(catalogLock);
+        std::map<std::string, Table*> touched;
+        for (const auto& statement : statements) {
+            auto it = tables.find(statement.table);
+            if (it == tables.end()) {
+                report("Error: Table {} not found, transaction rolled back\n", statement.table);
+                return false;
+            }
+            if (findShards(statement.table) != nullptr) {
+                report("Error: Transactions cannot write to sharded table {}, transaction rolled back\n", statement.table);
+                return false;
+            }
+            touched[statement.table] = &it->second;
+        }
+
+        std::vector<std::unique_lock<std::mutex>> writers;
+        std::vector<ExclusiveLock> tableLocks;
+        std::map<Table*, size_t> rowCounts;
+        for (auto& entry : touched) {
+            Table& table = *entry.second;
+            writers.emplace_back(table.latch->writerLock);
+            tableLocks.emplace_back(table.latch->lock);
+            if (!table.loadAllColumns()) {
+                return false;
+            }
+            rowCounts[&table] = table.rowCount;
+        }
+
+        // The writer locks keep the tables unchanged while the batch is made
+        // durable; readers are let in during the sync.
+        if (!statements.empty()) {
+            std::string record = logRecord(LogRecordType::Batch, "");
+            appendBinary<uint32_t>(record, static_cast<uint32_t>(statements.size()));
+            for (const auto& statement : statements) {
+                record += writeRecord(statement);
+            }
+            for (auto& lock : tableLocks) {
+                lock.unlock();
+            }
+            if (!logStatement(record)) {
+                return false;
+            }
+            for (auto& lock : tableLocks) {
+                lock.lock();
+            }
+        }
+
+        std::vector<ChangedRow> changed;
+        bool applied = installVersion([&](uint64_t version) {
+            for (const auto& statement : statements) {
+                if (!applyWrite(*touched[statement.table], statement, version, changed)) {
+                    for (auto it = changed.rbegin(); it != changed.rend(); ++it) {
+                        if (it->table->isDeleted(it->row)) {
+                            it->table->restoreRow(it->row);
+                        } else {
+                            it->table->overwriteRow(it->row, it->values, it->version);
+                        }
+                    }
+                    for (auto& entry : rowCounts) {
+                        entry.first->truncate(entry.second);
+                    }
+                    return false;
+                }
+            }
+            return true;
+        });
+        if (!applied) {
+            report("Error: Transaction rolled back\n");
+            return false;
+        }
+        for (auto& entry : touched) {
+            compactIfNeeded(*entry.second);
+        }
+        tableLocks.clear();
+        report("Transaction committed, {} statements applied\n", statements.size());
+        return true;
+    }
+
+    // Statistics are gathered from the rows visible to one snapshot, one
+    // column per task, and installed together so the planner never sees a mix.
+    void analyze(const std::string& tableName) {
+        SharedLock catalog(catalogLock);
+        auto it = tables.find(tableName);
+        if (it == tables.end()) {
+            report("Error: Table {} not found\n", tableName);
+            return;
+        }
+        if (findShards(tableName) != nullptr) {
+            report("Error: Cannot analyze sharded table {}\n", tableName);
+            return;
+        }
 
-class SimpleDatabase;
+        Table& table = it->second;
+        ExclusiveLock loadLock(table.latch->lock);
+        if (!table.loadAllColumns()) {
+            return;
+        }
+        loadLock.unlock();
 
-struct Table {
-    friend class SimpleDatabase;
+        SharedLock tableLock(table.latch->lock);
+        BoundStatement statement;
+        statement.snapshot = beginSnapshot(table);
+        std::vector<size_t> rows = orderedRows(table, statement, &tableLock);
+        std::vector<ColumnStats> stats(table.columns.size());
+        scheduler->parallelFor(stats.size(), [&table, &rows, &stats](size_t i) {
+            stats[i] = analyzeColumn(table.columns[i], rows);
+        });
+        endSnapshot(table, statement.snapshot);
+        tableLock.unlock();
 
-private:
-    std::string name;
-    std::vector<Column> columns;
-    std::vector<std::map<std::string, std::string>> rows;
+        ExclusiveLock installLock(table.latch->lock);
+        table.columnStats = stats;
+        installLock.unlock();
 
-    std::string getColumnType(const std::string& columnName) const {
-        for (const auto& column : columns) {
-            if (column.name == columnName) {
-                return column.type;
+        std::vector<Column> result(5);
+        const char* names[] = {"Column", "Nulls", "Distinct", "Min", "Max"};
+        for (size_t i = 0; i < result.size(); ++i) {
+            result[i].name = names[i];
+            result[i].type = i == 1 || i == 2 ? ColumnType::Int : ColumnType::String;
+        }
+        std::vector<size_t> listed;
+        for (size_t i = 0; i < stats.size(); ++i) {
+            Column bounds;
+            bounds.type = table.columns[i].type;
+            bounds.append(stats[i].min);
+            bounds.append(stats[i].max);
+            Value value;
+            value.isNull = false;
+            value.stringValue = table.columns[i].name;
+            result[0].append(value);
+            value.intValue = static_cast<int64_t>(stats[i].nulls);
+            result[1].append(value);
+            value.intValue = static_cast<int64_t>(std::llround(stats[i].distinct));
+            result[2].append(value);
+            for (size_t bound = 0; bound < 2; ++bound) {
+                if (bounds.nulls[bound]) {
+                    result[3 + bound].append(Value());
+                    continue;
+                }
+                value.stringValue.clear();
+                bounds.appendTo(value.stringValue, bound);
+                result[3 + bound].append(value);
             }
+            listed.push_back(i);
         }
-        return "";
+        writeResult(result, listed);
+        report("Table {} analyzed: {} rows\n", tableName, rows.size());
     }
 
-public:
-    Table() {}
+    void vacuum(const std::string& tableName) {
+        SharedLock catalog(catalogLock);
+        auto it = tables.find(tableName);
+        if (it != tables.end()) {
+            ShardSet* shards = findShards(tableName);
+            if (shards != nullptr) {
+                std::atomic<size_t> reclaimed{0};
+                ExclusiveLock writes(shards->writeLatch);
+                onShards(*shards, nullptr, [&reclaimed](Table& shard, size_t) {
+                    reclaimed += shard.compact(latestVersion);
+                });
+                report("Table {} vacuumed, {} deleted rows reclaimed\n", tableName, reclaimed.load());
+                return;
+            }
 
-    Table(const std::string& tableName, const std::vector<Column>& tableColumns) : name(tableName), columns(tableColumns) {}
+            Table& table = it->second;
+            std::lock_guard<std::mutex> writer(table.latch->writerLock);
+            ExclusiveLock tableLock(table.latch->lock);
+            // Waiting for the scans here would hold off every writer of the
+            // table for as long as they run, so vacuum leaves it to a later
+            // run or to the compaction that follows writes.
+            if (table.latch->scans.load() != 0) {
+                report("Table {} vacuum deferred, {} scans in progress\n", tableName, table.latch->scans.load());
+                return;
+            }
+            if (table.deletedCount != 0 && !table.loadAllColumns()) {
+                return;
+            }
+            size_t reclaimed = table.compact(oldestSnapshot());
+            report("Table {} vacuumed, {} deleted rows reclaimed\n", tableName, reclaimed);
+        } else {
+            report("Error: Table {} not found\n", tableName);
+        }
+    }
 
-    void createRow(const std::map<std::string, std::string>& data) {
-        std::map<std::string, std::string> newRow;
-        for (const auto& column : columns) {
-            newRow[column.name] = "";
+    void shardTable(const std::string& tableName, const std::string& columnName, size_t count) {
+        ExclusiveLock catalog(catalogLock);
+        auto it = tables.find(tableName);
+        if (it == tables.end()) {
+            report("Error: Table {} not found\n", tableName);
+            return;
+        }
+        Table& table = it->second;
+        size_t column = table.findColumn(columnName);
+        if (column == invalidColumn) {
+            report("Error: Column {} not found in table {}\n", columnName, tableName);
+            return;
+        }
+        if (!table.loadAllColumns()) {
+            return;
+        }
+        std::string record = logRecord(LogRecordType::Shard, tableName);
+        appendBinary(record, columnName);
+        appendBinary<uint32_t>(record, static_cast<uint32_t>(count));
+        if (!logStatement(record)) {
+            return;
         }
 
-        for (const auto& entry : data) {
-            auto columnIt = newRow.find(entry.first);
-            if (columnIt != newRow.end()) {
-                columnIt->second = entry.second;
-            } else {
-                fmt::print("Error: Column {} not found in table {}\n", entry.first, name);
-                return;
+        std::unique_ptr<ShardSet>& shards = shardedTables[tableName];
+        if (shards != nullptr) {
+            gatherShards(table, *shards);
+        }
+
+        std::vector<Column> schema;
+        for (const auto& source : table.columns) {
+            schema.push_back({source.name, source.type});
+        }
+        std::vector<Table> parts;
+        for (size_t i = 0; i < count; ++i) {
+            parts.emplace_back(tableName, schema);
+        }
+        table.forEachMatch(BoundStatement(), [&table, &parts, column, count](size_t row) {
+            std::vector<Value> values = table.rowValues(row);
+            parts[shardOf(values[column], count)].appendRow(values, 0);
+        });
+
+        Table emptied(tableName, schema);
+        for (const auto& index : table.indexes) {
+            emptied.createIndex(index.column);
+            for (auto& part : parts) {
+                part.createIndex(index.column);
+            }
+        }
+        for (const auto& index : table.orderedIndexes) {
+            emptied.createOrderedIndex(index->column);
+            for (auto& part : parts) {
+                part.createOrderedIndex(index->column);
             }
         }
+        table = std::move(emptied);
 
-        rows.push_back(newRow);
+        std::unique_ptr<ShardSet> created(new ShardSet());
+        created->keyColumn = column;
+        // Shard workers are pinned round robin to the cores left over by the
+        // scheduler's workers and the statement thread, and float like them
+        // when there are none.
+        size_t cores = std::max(1u, std::thread::hardware_concurrency());
+        size_t firstFree = scheduler->size() + 1;
+        size_t unpinned = 0;
+        for (size_t i = 0; i < count; ++i) {
+            int core = cores > firstFree ? static_cast<int>(firstFree + i % (cores - firstFree)) : -1;
+            created->workers.emplace_back(new ShardWorker(std::move(parts[i]), core));
+            unpinned += core >= 0 && !created->workers.back()->isPinned();
+        }
+        shards = std::move(created);
+        if (unpinned != 0) {
+            report("Error: Unable to pin {} shards of table {} to a core, they run unpinned\n", unpinned, tableName);
+        }
+        report("Table {} sharded on column {} into {} shards\n", tableName, columnName, count);
     }
-};
 
-class SimpleDatabase {
-private:
-    std::map<std::string, Table> tables;
+    void saveToBackup(const std::string& filename) {
+        startCheckpoint(filename, CheckpointKind::Text);
+    }
 
-    void saveToFile(const std::string& filename) {
-        std::ofstream file(filename);
-        if (file.is_open()) {
-            for (const auto& entry : tables) {
-                file << fmt::format("Table: {}\n", entry.first);
-                for (const auto& column : entry.second.columns) {
-                    file << fmt::format("  {} ({})\n", column.name, column.type);
-                }
-                for (const auto& row : entry.second.rows) {
-                    file << "  ";
-                    for (const auto& column : entry.second.columns) {
-                        file << fmt::format("{}: {}, ", column.name, row.at(column.name));
-                    }
-                    file << "\n";
-                }
+    void loadFromBackup(const std::string& filename) {
+        std::lock_guard<std::mutex> guard(checkpointLock);
+        pollCheckpoint(true);
+        std::string logged = filename;
+        if (wal != nullptr && access(filename.c_str(), F_OK) == 0) {
+            logged = keepFile(filename);
+            if (logged.empty()) {
+                return;
             }
-            file.close();
-            fmt::print("Database saved to {}\n", filename);
-        } else {
-            fmt::print("Error: Unable to open file for saving\n");
         }
+        loadFromFile(filename, logged);
     }
 
-public:
-    void createTable(const std::string& tableName, const std::vector<Column>& columns) {
-        Table table(tableName, columns);
-        tables[tableName] = table;
-        fmt::print("Table {} created\n", tableName);
+    void saveSnapshotToFile(const std::string& filename) {
+        startCheckpoint(filename, CheckpointKind::Snapshot);
     }
 
-    void addColumnToTable(const std::string& tableName, const Column& newColumn) {
-        auto it = tables.find(tableName);
-        if (it != tables.end()) {
-            auto columnIt = std::find_if(it->second.columns.begin(), it->second.columns.end(),
-                                         [&newColumn](const Column& existingColumn) {
-                                             return existingColumn.name == newColumn.name;
-                                         });
-
-            if (columnIt == it->second.columns.end()) {
-                it->second.columns.push_back(newColumn);
-                fmt::print("Column {} added to table {}\n", newColumn.name, tableName);
-            } else {
-                fmt::print("Error: Column {} already exists in table {}\n", newColumn.name, tableName);
-            }
+    void saveCheckpointToDirectory(const std::string& directory) {
+        startCheckpoint(directory, CheckpointKind::Incremental);
+    }
+
+    void checkpointStatus() {
+        std::lock_guard<std::mutex> guard(checkpointLock);
+        pollCheckpoint(false);
+        if (checkpointPid > 0) {
+            uint64_t written = checkpointProgress->written.load(std::memory_order_relaxed);
+            uint64_t total = checkpointProgress->total.load(std::memory_order_relaxed);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - checkpointStart).count();
+            report("Background save to {} running for {:.3f}s, {} of {} cells written ({:.1f}%)\n", checkpointFile, seconds, written, total, total == 0 ? 100.0 : 100.0 * written / total);
+        } else if (!lastCheckpoint.empty()) {
+            report("{}\n", lastCheckpoint);
         } else {
-            fmt::print("Error: Table {} not found\n", tableName);
+            report("No background save has run\n");
         }
     }
 
-    void insertData(const std::string& tableName, const std::map<std::string, std::string>& data) {
-        auto it = tables.find(tableName);
-        if (it != tables.end()) {
-            it->second.createRow(data);
-            fmt::print("Data inserted into table {}\n", tableName);
-        } else {
-            fmt::print("Error: Table {} not found\n", tableName);
+    void schedulerStatus() {
+        uint64_t uptime = std::max<uint64_t>(1, scheduler->uptimeNanos());
+        std::vector<Scheduler::WorkerStats> stats = scheduler->stats();
+        for (size_t i = 0; i < stats.size(); ++i) {
+            report("Worker {}: {} tasks, {} stolen, {} queued, {:.1f}% busy\n", i, stats[i].executed, stats[i].stolen, stats[i].queued, 100.0 * stats[i].busyNanos / uptime);
         }
     }
 
-    void updateData(const std::string& tableName, const std::map<std::string, std::string>& updateData, const std::map<std::string, std::string>& whereClause) {
-        auto it = tables.find(tableName);
+    void finishCheckpoint() {
+        std::lock_guard<std::mutex> guard(checkpointLock);
+        pollCheckpoint(true);
+    }
 
-        if (it != tables.end()) {
-            for (auto& row : it->second.rows) {
-                bool whereConditionSatisfied = true;
+    void pollBackgroundWork() {
+        std::lock_guard<std::mutex> guard(checkpointLock);
+        pollCheckpoint(false);
+    }
 
-                for (const auto& whereEntry : whereClause) {
-                    auto columnIt = row.find(whereEntry.first);
-                    if (columnIt == row.end() || columnIt->second != whereEntry.second) {
-                        whereConditionSatisfied = false;
-                        break;
-                    }
-                }
+    bool replayLog(const std::string& path) {
+        return WriteAheadLog::replay(path, [this](const char* data, size_t length) {
+            quietOutput = true;
+            bool applied = applyLogRecord(data, length);
+            quietOutput = false;
+            return applied;
+        });
+    }
 
-                if (whereConditionSatisfied) {
-                    for (const auto& entry : updateData) {
-                        auto columnIt = row.find(entry.first);
-                        if (columnIt != row.end()) {
-                            if (it->second.getColumnType(entry.first) == "int") {
-                                columnIt->second = std::to_string(std::stoi(entry.second));
-                            } else if (it->second.getColumnType(entry.first) == "double") {
-                                columnIt->second = std::to_string(std::stod(entry.second));
-                            } else {
-                                columnIt->second = entry.second;
-                            }
-                        } else {
-                            fmt::print("Error: Column {} not found in table {}\n", entry.first, tableName);
-                            return;
-                        }
-                    }
-                }
+    void attachLog(WriteAheadLog* log) {
+        wal = log;
+        std::ifstream file(wal->filePath(), std::ios::binary);
+        removeUnusedBases(std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>()));
+    }
+};
+
+struct Session {
+    std::vector<WriteStatement> transaction;
+    bool inTransaction = false;
+};
+
+bool executeCommand(SimpleDatabase& database, Session& session, const std::string& command) {
+    database.pollBackgroundWork();
+
+    std::istringstream iss(command);
+    std::string cmd;
+    iss >> cmd;
+
+    if (session.inTransaction && (cmd == "createTable" || cmd == "addColumn" || cmd == "createIndex" || cmd == "vacuum" || cmd == "load" || cmd == "shardTable")) {
+        report("Error: {} is not allowed inside a transaction\n", cmd);
+    } else if (cmd == "createTable") {
+        std::string tableName;
+        iss >> tableName;
+
+        std::vector<Column> columns;
+        std::string colName, colType;
+        bool validTypes = true;
+        while (iss >> colName >> colType) {
+            ColumnType type;
+            if (!parseColumnType(colType, type)) {
+                report("Error: Unknown column type {}\n", colType);
+                validTypes = false;
+                break;
             }
+            columns.push_back({colName, type});
+        }
 
-            fmt::print("Data updated in table {}\n", tableName);
-        } else {
-            fmt::print("Error: Table {} not found\n", tableName);
+        if (validTypes) {
+            database.createTable(tableName, columns);
         }
-    }
+    } else if (cmd == "addColumn") {
+        std::string tableName;
+        iss >> tableName;
 
-    void deleteData( std::string& tableName, std::map<std::string, std::string>& whereClause) {
-        auto it = tables.find(tableName);
+        std::string colName, colType;
+        iss >> colName >> colType;
 
-        if (it != tables.end()) {
-            for (auto rowIt = it->second.rows.begin(); rowIt != it->second.rows.end();) {
-                bool whereConditionSatisfied = true;
+        ColumnType type;
+        if (parseColumnType(colType, type)) {
+            database.addColumnToTable(tableName, {colName, type});
+        } else {
+            report("Error: Unknown column type {}\n", colType);
+        }
+    } else if (cmd == "createIndex") {
+        std::string tableName, colName, kind;
+        iss >> tableName >> colName >> kind;
 
-                for (const auto& whereEntry : whereClause) {
-                    auto columnIt = rowIt->find(whereEntry.first);
-                    if (columnIt == rowIt->end() || columnIt->second != whereEntry.second) {
-                        whereConditionSatisfied = false;
-                        break;
-                    }
-                }
+        if (kind.empty() || kind == "hash" || kind == "btree") {
+            database.createIndex(tableName, colName, kind == "btree");
+        } else {
+            report("Error: Unknown index kind {}\n", kind);
+        }
+    } else if (cmd == "shardTable") {
+        std::string tableName, colName, countText;
+        iss >> tableName >> colName >> countText;
 
-                if (whereConditionSatisfied) {
-                    rowIt = it->second.rows.erase(rowIt);
-                } else {
-                    ++rowIt;
-                }
+        char* end = nullptr;
+        unsigned long count = countText.empty() ? std::max(1u, std::thread::hardware_concurrency()) : std::strtoul(countText.c_str(), &end, 10);
+        if (!countText.empty() && (*end != '\0' || count == 0 || count > 1024)) {
+            report("Error: Invalid shard count {}\n", countText);
+        } else {
+            database.shardTable(tableName, colName, count);
+        }
+    } else if (cmd == "insert") {
+        std::string tableName;
+        iss >> tableName;
+
+        std::map<std::string, std::string> data;
+        std::string colInfo;
+        while (iss >> colInfo) {
+            size_t colonPos = colInfo.find(':');
+            if (colonPos != std::string::npos) {
+                std::string colName = colInfo.substr(0, colonPos);
+                std::string colValue = colInfo.substr(colonPos + 1);
+                data[colName] = colValue;
+            } else {
+                report("Error: Invalid column format in command\n");
+                break;
             }
+        }
 
-            fmt::print("Data deleted from table {}\n", tableName);
+        if (session.inTransaction) {
+            session.transaction.push_back({LogRecordType::Insert, tableName, data, nullptr});
+            report("Insert queued\n");
         } else {
-            fmt::print("Error: Table {} not found\n", tableName);
+            database.insertData(tableName, data);
+        }
+    } else if (cmd == "update") {
+        std::string tableName;
+        if (!(iss >> tableName)) {
+            report("Error: Missing table name for update command\n");
+            return true;
         }
-    }
 
-    void query(const std::string& tableName, const std::vector<std::string>& selectClause, const std::map<std::string, std::string>& whereClause) {
-        auto it = tables.find(tableName);
+        std::map<std::string, std::string> updateData;
+        std::unique_ptr<Expr> whereClause;
 
-        if (it != tables.end()) {
-            if (selectClause.empty()) {
-                for (const auto& column : it->second.columns) {
-                    std::cout << column.name << "\t";
-                }
+        std::string colInfo;
+        bool validWhere = true;
+
+        while (iss >> colInfo) {
+            if (colInfo == "where") {
+                std::string whereText;
+                std::getline(iss, whereText);
+                validWhere = WhereParser().parse(whereText, whereClause);
+                break;
+            }
+
+            size_t colonPos = colInfo.find(':');
+            if (colonPos != std::string::npos) {
+                std::string colName = colInfo.substr(0, colonPos);
+                std::string colValue = colInfo.substr(colonPos + 1);
+                updateData[colName] = colValue;
             } else {
-                for (const auto& col : selectClause) {
-                    std::cout << col << "\t";
-                }
+                report("Error: Invalid column format in command\n");
+                break;
             }
-            std::cout << "\n";
+        }
 
-            for (const auto& row : it->second.rows) {
-                bool whereConditionSatisfied = true;
+        if (validWhere && session.inTransaction) {
+            session.transaction.push_back({LogRecordType::Update, tableName, updateData, std::move(whereClause)});
+            report("Update queued\n");
+        } else if (validWhere) {
+            database.updateData(tableName, updateData, whereClause.get());
+        }
+    }else if (cmd == "query") {
+        QueryStatement query;
+        iss >> query.table;
 
-                for (const auto& whereEntry : whereClause) {
-                    auto columnIt = row.find(whereEntry.first);
-                    if (columnIt == row.end() || columnIt->second != whereEntry.second) {
-                        whereConditionSatisfied = false;
-                        break;
-                    }
-                }
+        std::vector<std::string> words;
+        std::string word;
+        while (iss >> word) {
+            words.push_back(word);
+        }
+        auto isClause = [&words](size_t i) {
+            bool by = i + 1 < words.size() && words[i + 1] == "by";
+            return ((words[i] == "group" || words[i] == "order") && by) || words[i] == "limit" || words[i] == "offset";
+        };
 
-                if (whereConditionSatisfied) {
-                    if (selectClause.empty()) {
-                        for (const auto& column : it->second.columns) {
-                            auto columnIt = row.find(column.name);
-                            if (columnIt != row.end()) {
-                                std::cout << columnIt->second << "\t";
-                            } else {
-                                fmt::print("Error: Column {} not found in table {}\n", column.name, tableName);
-                                return;
-                            }
-                        }
-                    } else {
-                        for (const auto& col : selectClause) {
-                            auto columnIt = row.find(col);
-                            if (columnIt != row.end()) {
-                                std::cout << columnIt->second << "\t";
-                            } else {
-                                fmt::print("Error: Column {} not found in table {}\n", col, tableName);
-                                return;
-                            }
+        size_t i = 0;
+        bool validWhere = true;
+        for (; i < words.size() && words[i] != "where" && words[i] != "join" && !isClause(i); ++i) {
+            const std::string& colInfo = words[i];
+            size_t colonPos = colInfo.find(':');
+            AggregateKind kind;
+            std::string argument;
+            if (colonPos != std::string::npos) {
+                query.select.push_back(colInfo.substr(0, colonPos));
+            } else if (Table::parseAggregate(colInfo, kind, argument)) {
+                query.select.push_back(colInfo);
+            } else {
+                report("Error: Invalid column format in command\n");
+                i = words.size();
+                break;
+            }
+        }
+
+        if (i < words.size() && words[i] == "join") {
+            size_t equals = i + 3 < words.size() ? words[i + 3].find_first_of("=:") : std::string::npos;
+            if (equals == std::string::npos || words[i + 2] != "on") {
+                report("Error: Expected join <table> on <column>=<column>\n");
+                validWhere = false;
+            } else {
+                query.join = words[i + 1];
+                query.joinLeft = words[i + 3].substr(0, equals);
+                query.joinRight = words[i + 3].substr(equals + 1);
+                i += 4;
+            }
+        }
+
+        if (validWhere && i < words.size() && words[i] == "where") {
+            std::string whereText;
+            for (++i; i < words.size() && !isClause(i); ++i) {
+                whereText += words[i];
+                whereText += ' ';
+            }
+            validWhere = WhereParser().parse(whereText, query.where);
+        }
+
+        while (validWhere && i < words.size()) {
+            if (!isClause(i)) {
+                report("Error: Unexpected {} in query\n", words[i]);
+                validWhere = false;
+            } else if (words[i] == "group") {
+                for (i += 2; i < words.size() && !isClause(i); ++i) {
+                    std::istringstream columns(words[i]);
+                    std::string column;
+                    while (std::getline(columns, column, ',')) {
+                        if (!column.empty()) {
+                            query.groupBy.push_back(column);
                         }
                     }
-                    std::cout << "\n";
                 }
+            } else if (words[i] == "order") {
+                i += 2;
+                if (i == words.size() || isClause(i)) {
+                    report("Error: Expected a column after order by\n");
+                    validWhere = false;
+                    break;
+                }
+                query.orderBy = words[i++];
+                if (i < words.size() && (words[i] == "asc" || words[i] == "desc")) {
+                    query.descending = words[i++] == "desc";
+                }
+            } else {
+                const std::string& clause = words[i];
+                char* end = nullptr;
+                errno = 0;
+                unsigned long long count = i + 1 < words.size() ? std::strtoull(words[i + 1].c_str(), &end, 10) : 0;
+                if (end == nullptr || *end != '\0' || errno != 0 || words[i + 1][0] == '-') {
+                    report("Error: Invalid {} in query\n", clause);
+                    validWhere = false;
+                    break;
+                }
+                (clause == "limit" ? query.limit : query.offset) = static_cast<size_t>(count);
+                i += 2;
             }
+        }
 
-            fmt::print("Query executed for table {}\n", tableName);
-        } else {
-            fmt::print("Error: Table {} not found\n", tableName);
+        if (validWhere) {
+            database.query(query);
         }
     }
 
 
-    void saveToBackup(const std::string& filename) {
-        saveToFile(filename);
-    }
-};
 
-int main() {
-    SimpleDatabase database;
+    else if(cmd=="delete"){
+        std::string tableName;
+        iss >> tableName;
 
-    std::string command;
-    while (true) {
-        std::cout << "> ";
-        std::getline(std::cin, command);
+        std::string whereText;
+        std::getline(iss >> std::ws, whereText);
+        if (whereText.compare(0, 6, "where ") == 0) {
+            whereText.erase(0, 6);
+        }
+
+        std::unique_ptr<Expr> whereClause;
+        bool validWhere = WhereParser().parse(whereText, whereClause);
+        if (validWhere && session.inTransaction) {
+            session.transaction.push_back({LogRecordType::Delete, tableName, {}, std::move(whereClause)});
+            report("Delete queued\n");
+        } else if (validWhere) {
+            database.deleteData(tableName, whereClause.get());
+        }
 
-        std::istringstream iss(command);
-        std::string cmd;
-        iss >> cmd;
+    }
+    else if (cmd == "analyze") {
+        std::string tableName;
+        iss >> tableName;
+        database.analyze(tableName);
+    } else if (cmd == "vacuum") {
+        std::string tableName;
+        iss >> tableName;
+        database.vacuum(tableName);
+    } else if (cmd == "save") {
+        std::string filename;
+        iss >> filename;
+        database.saveToBackup(filename);
+    } else if (cmd == "snapshot") {
+        std::string filename;
+        iss >> filename;
+        database.saveSnapshotToFile(filename);
+    } else if (cmd == "checkpoint") {
+        std::string directory;
+        iss >> directory;
+        database.saveCheckpointToDirectory(directory);
+    } else if (cmd == "load") {
+        std::string filename;
+        iss >> filename;
+        database.loadFromBackup(filename);
+    } else if (cmd == "schedulerStatus") {
+        database.schedulerStatus();
+    } else if (cmd == "saveStatus") {
+        database.checkpointStatus();
+    } else if (cmd == "begin") {
+        if (session.inTransaction) {
+            report("Error: A transaction is already in progress\n");
+        } else {
+            session.inTransaction = true;
+            report("Transaction started\n");
+        }
+    } else if (cmd == "commit" || cmd == "rollback") {
+        if (!session.inTransaction) {
+            report("Error: No transaction in progress\n");
+        } else {
+            if (cmd == "commit") {
+                database.commitTransaction(session.transaction);
+            } else {
+                report("Transaction rolled back\n");
+            }
+            session.transaction.clear();
+            session.inTransaction = false;
+        }
+    } else if (cmd == "exit") {
+        return false;
+    } else {
+        report("Unknown command. Try again.\n");
+    }
+    return true;
+}
+
+class Server {
+public:
+    explicit Server(SimpleDatabase& serverDatabase) : database(serverDatabase) {}
+
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
 
-        if (cmd == "createTable") {
-            std::string tableName;
-            iss >> tableName;
+    ~Server() {
+        for (auto& listener : listeners) {
+            close(listener->fd);
+        }
+    }
 
-            std::vector<Column> columns;
-            std::string colName, colType;
-            while (iss >> colName >> colType) {
-                columns.push_back({colName, colType});
+    // Text listeners speak the prompt protocol; binary listeners speak the
+    // framed protocol written by FrameWriter.
+    bool listen(const std::string& address, bool binary) {
+        int fd = -1;
+        bool tcp = false;
+        bool ok;
+        if (address.find('/') != std::string::npos) {
+            sockaddr_un local{};
+            if (address.size() >= sizeof(local.sun_path)) {
+                return false;
+            }
+            local.sun_family = AF_UNIX;
+            std::memcpy(local.sun_path, address.c_str(), address.size() + 1);
+            unlink(address.c_str());
+            fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            ok = fd >= 0 && bind(fd, reinterpret_cast<sockaddr*>(&local), sizeof(local)) == 0 && ::listen(fd, SOMAXCONN) == 0;
+        } else {
+            char* end = nullptr;
+            long port = std::strtol(address.c_str(), &end, 10);
+            if (address.empty() || *end != '\0' || port <= 0 || port > 65535) {
+                return false;
             }
+            sockaddr_in local{};
+            local.sin_family = AF_INET;
+            local.sin_port = htons(static_cast<uint16_t>(port));
+            local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            int enable = 1;
+            tcp = true;
+            ok = fd >= 0 && setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) == 0 && bind(fd, reinterpret_cast<sockaddr*>(&local), sizeof(local)) == 0 && ::listen(fd, SOMAXCONN) == 0;
+        }
 
-            database.createTable(tableName, columns);
-        } else if (cmd == "addColumn") {
-            std::string tableName;
-            iss >> tableName;
-
-            std::string colName, colType;
-            iss >> colName >> colType;
-
-            database.addColumnToTable(tableName, {colName, colType});
-        } else if (cmd == "insert") {
-            std::string tableName;
-            iss >> tableName;
-
-            std::map<std::string, std::string> data;
-            std::string colInfo;
-            while (iss >> colInfo) {
-                size_t colonPos = colInfo.find(':');
-                if (colonPos != std::string::npos) {
-                    std::string colName = colInfo.substr(0, colonPos);
-                    std::string colValue = colInfo.substr(colonPos + 1);
-                    data[colName] = colValue;
-                } else {
-                    fmt::print("Error: Invalid column format in command\n");
-                    break;
-                }
+        if (!ok) {
+            if (fd >= 0) {
+                close(fd);
             }
+            return false;
+        }
+        std::unique_ptr<Connection> listener(new Connection(fd));
+        listener->listening = true;
+        listener->binary = binary;
+        listener->tcp = tcp;
+        listeners.push_back(std::move(listener));
+        return true;
+    }
 
-            database.insertData(tableName, data);
-        } else if (cmd == "update") {
-            std::string tableName;
-            if (!(iss >> tableName)) {
-                fmt::print("Error: Missing table name for update command\n");
+    // Every loop owns its connections and runs their commands inline; the
+    // table locks let loops on different cores execute statements together.
+    void run(size_t loops) {
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < loops; ++i) {
+            threads.emplace_back(&Server::eventLoop, this);
+        }
+        eventLoop();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+private:
+    struct Connection {
+        explicit Connection(int socket) : fd(socket) {}
+
+        int fd;
+        std::string input;
+        std::string output;
+        Session session;
+        bool listening = false;
+        bool binary = false;
+        bool tcp = false;
+        bool closing = false;
+        bool writing = false;
+    };
+
+    SimpleDatabase& database;
+    std::vector<std::unique_ptr<Connection>> listeners;
+
+    void acceptClients(int epollFd, const Connection& listener) {
+        while (true) {
+            int fd = accept4(listener.fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                return;
+            }
+            if (listener.tcp) {
+                int enable = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+            }
+            Connection* connection = new Connection(fd);
+            connection->binary = listener.binary;
+            if (!connection->binary) {
+                connection->output = "> ";
+            }
+            epoll_event event{};
+            event.events = EPOLLIN | EPOLLRDHUP;
+            event.data.ptr = connection;
+            if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+                close(fd);
+                delete connection;
                 continue;
             }
+            flush(epollFd, connection);
+        }
+    }
 
-            std::map<std::string, std::string> updateData;
-            std::map<std::string, std::string> whereClause;
+    bool receive(Connection& connection) {
+        char buffer[65536];
+        while (true) {
+            ssize_t count = recv(connection.fd, buffer, sizeof(buffer), 0);
+            if (count > 0) {
+                connection.input.append(buffer, static_cast<size_t>(count));
+            } else if (count == 0) {
+                connection.closing = true;
+                return true;
+            } else {
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+        }
+    }
 
-            std::string colInfo;
-            bool isWhereClause = false;
+    void execute(Connection& connection) {
+        size_t begin = 0;
+        capturedOutput = &connection.output;
+        while (!connection.closing) {
+            size_t newline = connection.input.find('\n', begin);
+            if (newline == std::string::npos) {
+                break;
+            }
+            size_t end = newline > begin && connection.input[newline - 1] == '\r' ? newline - 1 : newline;
+            if (executeCommand(database, connection.session, connection.input.substr(begin, end - begin))) {
+                connection.output += "> ";
+            } else {
+                connection.closing = true;
+            }
+            begin = newline + 1;
+        }
+        capturedOutput = nullptr;
+        connection.input.erase(0, begin);
+    }
 
-            while (iss >> colInfo) {
-                if (colInfo == "where") {
-                    isWhereClause = true;
-                    continue;
-                }
+    // Requests are Command frames whose payload is the command text. Every
+    // complete frame already received runs before replying, so pipelined
+    // requests are answered with a single send.
+    void executeFrames(Connection& connection) {
+        size_t begin = 0;
+        while (!connection.closing && connection.input.size() - begin >= sizeof(uint32_t)) {
+            uint32_t length;
+            std::memcpy(&length, connection.input.data() + begin, sizeof(length));
+            if (length < sizeof(uint32_t) + sizeof(uint8_t) || length > maxFrameSize) {
+                FrameWriter(connection.output, 0).message(FrameType::Error, "Invalid frame length");
+                connection.closing = true;
+                break;
+            }
+            if (connection.input.size() - begin - sizeof(uint32_t) < length) {
+                break;
+            }
 
-                size_t colonPos = colInfo.find(':');
-                if (colonPos != std::string::npos) {
-                    std::string colName = colInfo.substr(0, colonPos);
-                    std::string colValue = colInfo.substr(colonPos + 1);
+            const char* frame = connection.input.data() + begin + sizeof(uint32_t);
+            ByteReader reader(frame, frame + length);
+            uint32_t statement = reader.read<uint32_t>();
+            FrameType type = static_cast<FrameType>(reader.read<uint8_t>());
+            FrameWriter frames(connection.output, statement);
+            if (type != FrameType::Command) {
+                frames.message(FrameType::Error, "Unknown frame type");
+            } else {
+                frameOutput = &frames;
+                connection.closing = !executeCommand(database, connection.session, std::string(reader.pos, reader.end));
+                frameOutput = nullptr;
+            }
+            frames.done();
+            begin += sizeof(uint32_t) + length;
+        }
+        connection.input.erase(0, begin);
+    }
 
-                    if (isWhereClause) {
-                        whereClause[colName] = colValue;
-                    } else {
-                        updateData[colName] = colValue;
-                    }
-                } else {
-                    fmt::print("Error: Invalid column format in command\n");
-                    break;
+    bool flush(int epollFd, Connection* connection) {
+        size_t sent = 0;
+        while (sent < connection->output.size()) {
+            ssize_t count = send(connection->fd, connection->output.data() + sent, connection->output.size() - sent, MSG_NOSIGNAL);
+            if (count < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    return false;
                 }
+                break;
             }
+            sent += static_cast<size_t>(count);
+        }
+        connection->output.erase(0, sent);
 
-            database.updateData(tableName, updateData, whereClause);
-        }else if (cmd == "query") {
-            std::string tablename;
-            iss >> tablename;
-
-            std::map<std::string, std::string> whereClause;
-            std::vector<std::string> selectClause;
+        bool writing = !connection->output.empty();
+        if (writing != connection->writing) {
+            epoll_event event{};
+            event.events = writing ? EPOLLIN | EPOLLRDHUP | EPOLLOUT : EPOLLIN | EPOLLRDHUP;
+            event.data.ptr = connection;
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, connection->fd, &event);
+            connection->writing = writing;
+        }
+        return writing || !connection->closing;
+    }
 
-            std::string colInfo;
-            bool isWhereClause = false;
-            while (iss >> colInfo) {
-                size_t colonPos = colInfo.find(':');
+    void eventLoop() {
+        int epollFd = epoll_create1(EPOLL_CLOEXEC);
+        bool started = epollFd >= 0;
+        for (auto& listener : listeners) {
+            epoll_event listen{};
+            listen.events = EPOLLIN | EPOLLEXCLUSIVE;
+            listen.data.ptr = listener.get();
+            started = started && epoll_ctl(epollFd, EPOLL_CTL_ADD, listener->fd, &listen) == 0;
+        }
+        if (!started) {
+            report("Error: Unable to start event loop\n");
+            return;
+        }
 
-                if (colInfo == "where") {
-                    isWhereClause = true;
+        epoll_event events[64];
+        while (true) {
+            int ready = epoll_wait(epollFd, events, 64, -1);
+            for (int i = 0; i < ready; ++i) {
+                Connection* connection = static_cast<Connection*>(events[i].data.ptr);
+                if (connection->listening) {
+                    acceptClients(epollFd, *connection);
                     continue;
                 }
 
-                if (colonPos != std::string::npos) {
-                    std::string colName = colInfo.substr(0, colonPos);
-                    std::string colValue = colInfo.substr(colonPos + 1);
-
-                    if (isWhereClause) {
-                        whereClause[colName] = colValue;
+                bool open = true;
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    open = receive(*connection);
+                    if (connection->binary) {
+                        executeFrames(*connection);
                     } else {
-                        selectClause.push_back(colName);
+                        execute(*connection);
                     }
-
-                } else {
-                    fmt::print("Error: Invalid column format in command\n");
-                    break;
+                }
+                open = open && flush(epollFd, connection);
+                if (!open) {
+                    epoll_ctl(epollFd, EPOLL_CTL_DEL, connection->fd, nullptr);
+                    close(connection->fd);
+                    delete connection;
                 }
             }
-
-
-            database.query(tablename, selectClause, whereClause);
         }
+    }
+};
 
+int main(int argc, char* argv[]) {
+    std::string walPath;
+    std::string serveAddress;
+    std::string wireAddress;
+    size_t workers = std::max(1u, std::thread::hardware_concurrency()) - 1;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--wal" && i + 1 < argc) {
+            walPath = argv[++i];
+        } else if (arg == "--serve" && i + 1 < argc) {
+            serveAddress = argv[++i];
+        } else if (arg == "--wire" && i + 1 < argc) {
+            wireAddress = argv[++i];
+        } else if (arg == "--workers" && i + 1 < argc) {
+            char* end = nullptr;
+            workers = std::strtoul(argv[++i], &end, 10);
+            if (*end != '\0' || workers > 1024) {
+                fmt::print("Error: Invalid worker count {}\n", argv[i]);
+                return 1;
+            }
+        } else if (arg == "--kernels" && i + 1 < argc) {
+            widestKernels = argv[++i];
+            if (widestKernels != "avx2" && widestKernels != "sse4.2" && widestKernels != "scalar") {
+                fmt::print("Error: Invalid kernels {}\n", widestKernels);
+                return 1;
+            }
+        } else {
+            fmt::print("Usage: {} [--wal <file>] [--serve <port|socket path>] [--wire <port|socket path>] [--workers <count>] [--kernels <avx2|sse4.2|scalar>]\n", argv[0]);
+            return 1;
+        }
+    }
 
+    SimpleDatabase database(workers);
 
-        else if(cmd=="delete"){
-            std::string tableName;
-            iss >> tableName;
-
-            std::map<std::string, std::string> whereClause;
-            std::string colInfo;
+    WriteAheadLog wal;
+    if (!walPath.empty()) {
+        if (!database.replayLog(walPath) || !wal.open(walPath)) {
+            fmt::print("Error: Unable to open write-ahead log {}\n", walPath);
+            return 1;
+        }
+        database.attachLog(&wal);
+    }
 
-            while(iss >> colInfo){
-                size_t colonPos = colInfo.find(':');
-                if (colonPos != std::string::npos) {
-                    std::string colName = colInfo.substr(0, colonPos);
-                    std::string colValue = colInfo.substr(colonPos + 1);
-                    whereClause[colName] = colValue;
-                } else {
-                    fmt::print("Error: Invalid column format in command\n");
-                    break;
-                }
+    if (!serveAddress.empty() || !wireAddress.empty()) {
+        Server server(database);
+        const std::pair<std::string, bool> endpoints[] = {{serveAddress, false}, {wireAddress, true}};
+        for (const auto& endpoint : endpoints) {
+            if (endpoint.first.empty()) {
+                continue;
             }
-
-            database.deleteData(tableName, whereClause);
-
+            if (!server.listen(endpoint.first, endpoint.second)) {
+                fmt::print("Error: Unable to listen on {}\n", endpoint.first);
+                return 1;
+            }
+            fmt::print("Listening on {}\n", endpoint.first);
         }
-        else if (cmd == "save") {
-            std::string filename;
-            iss >> filename;
-            database.saveToBackup(filename);
-        } else if (cmd == "exit") {
+        std::fflush(stdout);
+        server.run(std::max(1u, std::thread::hardware_concurrency()));
+        return 0;
+    }
+
+    Session session;
+    std::string command;
+    while (true) {
+        std::cout << "> ";
+        std::cout.flush();
+        if (!std::getline(std::cin, command) || !executeCommand(database, session, command)) {
             break;
-        } else {
-            std::cout << "Unknown command. Try again.\n";
         }
+        std::fflush(stdout);
     }
+    database.finishCheckpoint();
 
     return 0;
 }
 
-
 /*
 
         createTable Employees ID int Name string Salary double Department string
@@ -0,0 +1,189 @@
+#!/bin/sh
+# Drives the database prompt with command scripts and compares what it prints.
+# Usage: tests/repl_test.sh <path to database binary>
+
+database=${1:?usage: $0 <database binary>}
+case $database in
+    /*) ;;
+    *) database=$PWD/$database ;;
+esac
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work" || exit 1
+failures=0
+
+# run <name> [options...]: feeds <name>.in to the prompt, with timings masked
+# and trailing tabs dropped.
+run() {
+    name=$1
+    shift
+    timeout 60 "$database" "$@" < "$name.in" |
+        awk '{ sub(/ in [0-9.]+s/, " in Ns"); sub(/[ \t]+$/, ""); print }' > "$name.out"
+}
+
+# check <name>: compares <name>.out with the expected output on stdin.
+check() {
+    if cat | diff -u - "$1.out"; then
+        echo "PASS $1"
+    else
+        echo "FAIL $1"
+        failures=$((failures + 1))
+    fi
+}
+
+cat > roundtrip.in <<'EOF'
+createTable People ID int Name string Score double
+createIndex People ID
+insert People ID:1 Name:Ann Score:1.5
+insert People ID:2 Name:Bob
+insert People ID:3 Name:Cy Score:-2.25
+update People Score:9 where ID:2
+delete People ID:3
+insert People ID:4 Name:Di
+save people.txt
+snapshot people.bin
+checkpoint people
+exit
+EOF
+run roundtrip
+check roundtrip <<'EOF'
+> Table People created
+> Index created on column ID of table People
+> Data inserted into table People
+> Data inserted into table People
+> Data inserted into table People
+> Data updated in table People
+> Data deleted from table People
+> Data inserted into table People
+> Background save to people.txt started
+> Database saved to people.txt in Ns
+Background save to people.bin started
+> Snapshot saved to people.bin in Ns
+Background save to people started
+> Checkpoint saved to people in Ns, 1 of 1 chunks written
+EOF
+
+cat > reload.in <<'EOF'
+load people.txt
+query People
+load people.bin
+query People where Score>1
+load people
+query People Name: order by Score desc
+exit
+EOF
+run reload
+check reload <<'EOF'
+> Database loaded from people.txt
+> ID	Name	Score
+1	Ann	1.5
+2	Bob	9
+4	Di
+Query executed for table People
+> Database loaded from people.bin
+> ID	Name	Score
+1	Ann	1.5
+2	Bob	9
+Query executed for table People
+> Database loaded from people
+> Name
+Di
+Bob
+Ann
+Query executed for table People
+>
+EOF
+
+cat > logged.in <<'EOF'
+createTable Accounts ID int Balance int
+insert Accounts ID:1 Balance:100
+insert Accounts ID:2 Balance:50
+begin
+update Accounts Balance:70 where ID:1
+update Accounts Balance:80 where ID:2
+commit
+delete Accounts ID:1
+insert Accounts ID:3 Balance:5
+exit
+EOF
+run logged --wal accounts.wal
+printf 'query Accounts\ninsert Accounts ID:4 Balance:1\nexit\n' > replay.in
+run replay --wal accounts.wal
+check replay <<'EOF'
+> ID	Balance
+2	80
+3	5
+Query executed for table Accounts
+> Data inserted into table Accounts
+>
+EOF
+printf 'query Accounts count(*) sum(Balance)\nexit\n' > replayagain.in
+run replayagain --wal accounts.wal
+check replayagain <<'EOF'
+> count(*)	sum(Balance)
+3	86
+Query executed for table Accounts
+>
+EOF
+
+cat > rollback.in <<'EOF'
+createTable T A int B string
+insert T A:1 B:kept
+begin
+update T B:changed where A:1
+insert T A:2 B:new
+insert T A:x B:bad
+commit
+query T
+exit
+EOF
+run rollback
+check rollback <<'EOF'
+> Table T created
+> Data inserted into table T
+> Transaction started
+> Update queued
+> Insert queued
+> Insert queued
+> Error: Invalid int value x for column A
+Error: Transaction rolled back
+> A	B
+1	kept
+Query executed for table T
+>
+EOF
+
+# The same scans with each kernel width must match row for row, including
+# nulls and negative, equal and boundary values around each 1024-row batch.
+awk 'BEGIN {
+    print "createTable K I int D double"
+    for (n = 0; n < 40000; ++n) {
+        i = (n * 7919) % 2001 - 1000
+        d = ((n * 104729) % 4001 - 2000) / 8
+        if (n % 97 == 0) print "insert K D:" d
+        else if (n % 89 == 0) print "insert K I:" i
+        else print "insert K I:" i " D:" d
+    }
+    split("= != < <= > >=", ops, " ")
+    for (o = 1; o <= 6; ++o) {
+        print "query K count(*) sum(I) where I" ops[o] "17"
+        print "query K count(*) sum(I) where D" ops[o] "-3.25"
+        print "query K I: D: where I" ops[o] "-1000 limit 40"
+        print "query K count(*) where I" ops[o] "5 and D" ops[7 - o] "0.125"
+    }
+    print "exit"
+}' > kernels.in
+run kernels --kernels scalar
+mv kernels.out scalar.out
+for kernels in sse4.2 avx2; do
+    run kernels --kernels $kernels
+    if cmp -s scalar.out kernels.out && ! grep -q Error kernels.out; then
+        echo "PASS kernels $kernels"
+    else
+        diff -u scalar.out kernels.out | head -20
+        echo "FAIL kernels $kernels"
+        failures=$((failures + 1))
+    fi
+done
+
+[ "$failures" -eq 0 ]